@@ -0,0 +1,491 @@
+/* blake3.c - BLAKE3 for merkle
+ * BLAKE3 is a merkle tree itself: 1K chunks are hashed on their own and their
+ * chaining values combined pairwise, so independent chunks can go through the
+ * compression function side by side, one per 32-bit vector lane, sixteen at
+ * once on AVX-512 or eight on AVX2. blake3_hasher does that for the chunks of
+ * a long stream, and its batch entry point does it across merkle leaves,
+ * walking all of them through their chunks in step. Without either it is plain
+ * C. Output is the standard 32-byte unkeyed BLAKE3 hash.
+ */
+
+#include <immintrin.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "merkle.h"
+
+enum {
+	BLOCK = 64,
+	CHUNK = 1024,
+	MAXSTACK = 54,		/* 2^64 bytes of chunks */
+
+	CHUNK_START = 1,
+	CHUNK_END = 2,
+	PARENT = 4,
+	ROOT = 8
+};
+
+struct blake3 {
+	uint32_t cv[8];		/* of the chunk so far */
+	uint64_t chunk;		/* its number */
+	unsigned char buf[BLOCK];
+	size_t fill;
+	int blocks;		/* compressed in this chunk */
+	int nstack;
+	uint32_t stack[MAXSTACK][8];	/* finished subtrees, largest first */
+};
+
+static const uint32_t IV[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* message word order for each round */
+static const unsigned char SIGMA[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+};
+
+static uint32_t le32(const unsigned char *p) {
+	return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 |
+	       (uint32_t)p[1] << 8 | p[0];
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* One round, in terms of whatever ADD, XOR and R16..R7 (rotates right) are
+ * defined as where it's used; the scalar and vector compressions share it. */
+#define G(a, b, c, d, x, y) do { \
+	a = ADD(ADD(a, b), x); d = R16(XOR(d, a)); \
+	c = ADD(c, d); b = R12(XOR(b, c)); \
+	a = ADD(ADD(a, b), y); d = R8(XOR(d, a)); \
+	c = ADD(c, d); b = R7(XOR(b, c)); \
+} while (0)
+
+#define ROUND(v, m, s) do { \
+	G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]); \
+	G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]); \
+	G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]); \
+	G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]); \
+	G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]); \
+	G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]); \
+	G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]); \
+	G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]); \
+} while (0)
+
+#define ADD(a, b)	((a) + (b))
+#define XOR(a, b)	((a) ^ (b))
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define R16(x)		ROR(x, 16)
+#define R12(x)		ROR(x, 12)
+#define R8(x)		ROR(x, 8)
+#define R7(x)		ROR(x, 7)
+
+static void compress(uint32_t cv[8], const uint32_t m[16], uint64_t counter,
+                     uint32_t len, uint32_t flags) {
+	uint32_t v[16];
+	int i;
+
+	memcpy(v, cv, 32);
+	memcpy(v + 8, IV, 16);
+	v[12] = counter;
+	v[13] = counter >> 32;
+	v[14] = len;
+	v[15] = flags;
+	for (i = 0; i < 7; i++)
+		ROUND(v, m, SIGMA[i]);
+	for (i = 0; i < 8; i++)
+		cv[i] = v[i] ^ v[i + 8];
+}
+
+#undef ADD
+#undef XOR
+#undef R16
+#undef R12
+#undef R8
+#undef R7
+
+static void compress_bytes(uint32_t cv[8], const unsigned char *p,
+                           uint64_t counter, uint32_t len, uint32_t flags) {
+	uint32_t m[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = le32(p + 4 * i);
+	compress(cv, m, counter, len, flags);
+}
+
+static void parent(uint32_t cv[8], const uint32_t left[8], uint32_t flags) {
+	uint32_t m[16];
+
+	memcpy(m, left, 32);
+	memcpy(m + 8, cv, 32);
+	memcpy(cv, IV, 32);
+	compress(cv, m, 0, BLOCK, PARENT | flags);
+}
+
+/* Every lane hashes len bytes from base + i*stride as one chunk numbered
+ * counter + i*inc, with flags on its last block; the chaining values go to
+ * out, 32 bytes apiece. A partial (or empty) last block is copied out and
+ * padded, so lanes never read past len. */
+#define ADD(a, b)	_mm256_add_epi32(a, b)
+#define XOR(a, b)	_mm256_xor_si256(a, b)
+#define R16(x)		_mm256_shuffle_epi8(x, r16)
+#define R12(x)		_mm256_or_si256(_mm256_srli_epi32(x, 12), \
+			                _mm256_slli_epi32(x, 20))
+#define R8(x)		_mm256_shuffle_epi8(x, r8)
+#define R7(x)		_mm256_or_si256(_mm256_srli_epi32(x, 7), \
+			                _mm256_slli_epi32(x, 25))
+
+__attribute__((target("avx2")))
+static void chunks_x8(const unsigned char *base, size_t stride, size_t len,
+                      uint64_t counter, int inc, uint32_t flags,
+                      unsigned char *out) {
+	const __m256i r16 = _mm256_setr_epi8(
+	        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+	        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	const __m256i r8 = _mm256_setr_epi8(
+	        1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+	        1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+	const __m256i idx = _mm256_setr_epi32(0, stride, 2 * stride,
+	        3 * stride, 4 * stride, 5 * stride, 6 * stride, 7 * stride);
+	const __m256i tidx = _mm256_setr_epi32(0, 64, 128, 192, 256, 320, 384,
+	                                       448);
+	size_t nblocks = len ? (len + BLOCK - 1) / BLOCK : 1, b;
+	unsigned char tail[8][BLOCK];
+	uint32_t lo[8], hi[8], lanes[8][8];
+	__m256i h[8], v[16], m[16], ix;
+	const unsigned char *p;
+	uint32_t f;
+	int i, j;
+
+	for (j = 0; j < 8; j++) {
+		lo[j] = counter + (uint64_t)j * inc;
+		hi[j] = (counter + (uint64_t)j * inc) >> 32;
+		if (len % BLOCK || !len) {
+			memset(tail[j], 0, BLOCK);
+			memcpy(tail[j], base + j * stride + (nblocks - 1) * BLOCK,
+			       len % BLOCK);
+		}
+	}
+	for (i = 0; i < 8; i++)
+		h[i] = _mm256_set1_epi32(IV[i]);
+	for (b = 0; b < nblocks; b++) {
+		p = base + b * BLOCK;
+		ix = idx;
+		if (b == nblocks - 1 && (len % BLOCK || !len)) {
+			p = tail[0];
+			ix = tidx;
+		}
+		for (i = 0; i < 16; i++)
+			m[i] = _mm256_i32gather_epi32((const int *)(p + 4 * i),
+			                              ix, 1);
+		f = b ? 0 : CHUNK_START;
+		if (b == nblocks - 1)
+			f |= CHUNK_END | flags;
+		for (i = 0; i < 8; i++)
+			v[i] = h[i];
+		for (i = 0; i < 4; i++)
+			v[8 + i] = _mm256_set1_epi32(IV[i]);
+		v[12] = _mm256_loadu_si256((const __m256i *)lo);
+		v[13] = _mm256_loadu_si256((const __m256i *)hi);
+		v[14] = _mm256_set1_epi32(b == nblocks - 1 ? len - b * BLOCK :
+		                                             BLOCK);
+		v[15] = _mm256_set1_epi32(f);
+		for (i = 0; i < 7; i++)
+			ROUND(v, m, SIGMA[i]);
+		for (i = 0; i < 8; i++)
+			h[i] = XOR(v[i], v[i + 8]);
+	}
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)lanes[i], h[i]);
+	for (j = 0; j < 8; j++)
+		for (i = 0; i < 8; i++)
+			put32(out + 32 * j + 4 * i, lanes[i][j]);
+}
+
+#undef ADD
+#undef XOR
+#undef R16
+#undef R12
+#undef R8
+#undef R7
+
+#define ADD(a, b)	_mm512_add_epi32(a, b)
+#define XOR(a, b)	_mm512_xor_si512(a, b)
+#define R16(x)		_mm512_ror_epi32(x, 16)
+#define R12(x)		_mm512_ror_epi32(x, 12)
+#define R8(x)		_mm512_ror_epi32(x, 8)
+#define R7(x)		_mm512_ror_epi32(x, 7)
+
+/* chunks_x8() again, sixteen wide, with real rotates. */
+__attribute__((target("avx512f")))
+static void chunks_x16(const unsigned char *base, size_t stride, size_t len,
+                       uint64_t counter, int inc, uint32_t flags,
+                       unsigned char *out) {
+	const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+	                                       11, 12, 13, 14, 15);
+	const __m512i idx = _mm512_mullo_epi32(_mm512_set1_epi32(stride), lane);
+	const __m512i tidx = _mm512_slli_epi32(lane, 6);
+	size_t nblocks = len ? (len + BLOCK - 1) / BLOCK : 1, b;
+	unsigned char tail[16][BLOCK];
+	uint32_t lo[16], hi[16], lanes[8][16];
+	__m512i h[8], v[16], m[16], ix;
+	const unsigned char *p;
+	uint32_t f;
+	int i, j;
+
+	for (j = 0; j < 16; j++) {
+		lo[j] = counter + (uint64_t)j * inc;
+		hi[j] = (counter + (uint64_t)j * inc) >> 32;
+		if (len % BLOCK || !len) {
+			memset(tail[j], 0, BLOCK);
+			memcpy(tail[j], base + j * stride + (nblocks - 1) * BLOCK,
+			       len % BLOCK);
+		}
+	}
+	for (i = 0; i < 8; i++)
+		h[i] = _mm512_set1_epi32(IV[i]);
+	for (b = 0; b < nblocks; b++) {
+		p = base + b * BLOCK;
+		ix = idx;
+		if (b == nblocks - 1 && (len % BLOCK || !len)) {
+			p = tail[0];
+			ix = tidx;
+		}
+		for (i = 0; i < 16; i++)
+			m[i] = _mm512_i32gather_epi32(ix, (const int *)(p + 4 * i),
+			                              1);
+		f = b ? 0 : CHUNK_START;
+		if (b == nblocks - 1)
+			f |= CHUNK_END | flags;
+		for (i = 0; i < 8; i++)
+			v[i] = h[i];
+		for (i = 0; i < 4; i++)
+			v[8 + i] = _mm512_set1_epi32(IV[i]);
+		v[12] = _mm512_loadu_si512(lo);
+		v[13] = _mm512_loadu_si512(hi);
+		v[14] = _mm512_set1_epi32(b == nblocks - 1 ? len - b * BLOCK :
+		                                             BLOCK);
+		v[15] = _mm512_set1_epi32(f);
+		for (i = 0; i < 7; i++)
+			ROUND(v, m, SIGMA[i]);
+		for (i = 0; i < 8; i++)
+			h[i] = XOR(v[i], v[i + 8]);
+	}
+	for (i = 0; i < 8; i++)
+		_mm512_storeu_si512(lanes[i], h[i]);
+	for (j = 0; j < 16; j++)
+		for (i = 0; i < 8; i++)
+			put32(out + 32 * j + 4 * i, lanes[i][j]);
+}
+
+#undef ADD
+#undef XOR
+#undef R16
+#undef R12
+#undef R8
+#undef R7
+
+static void (*chunks)(const unsigned char *base, size_t stride, size_t len,
+                      uint64_t counter, int inc, uint32_t flags,
+                      unsigned char *out);
+static int lanes = -1;
+
+static void dispatch(void) {
+	__builtin_cpu_init();
+	lanes = 0;
+	if (__builtin_cpu_supports("avx512f")) {
+		chunks = chunks_x16;
+		lanes = 16;
+	} else if (__builtin_cpu_supports("avx2")) {
+		chunks = chunks_x8;
+		lanes = 8;
+	}
+}
+
+/* Adds the chaining value of chunk number total - 1, merging every subtree
+ * it completes, which is one per trailing zero bit of total. */
+static void push(struct blake3 *ctx, uint32_t cv[8], uint64_t total) {
+	for (; !(total & 1); total >>= 1)
+		parent(cv, ctx->stack[--ctx->nstack], 0);
+	memcpy(ctx->stack[ctx->nstack++], cv, 32);
+}
+
+static void words(uint32_t cv[8], const unsigned char *p) {
+	int i;
+
+	for (i = 0; i < 8; i++)
+		cv[i] = le32(p + 4 * i);
+}
+
+static void newchunk(struct blake3 *ctx, uint64_t chunk) {
+	memcpy(ctx->cv, IV, 32);
+	ctx->chunk = chunk;
+	ctx->fill = 0;
+	ctx->blocks = 0;
+}
+
+static void *blake3_new(void *aux) {
+	(void)aux;
+	if (lanes == -1)
+		dispatch();
+	return malloc(sizeof(struct blake3));
+}
+
+static void blake3_free(void *aux, void *hash) {
+	(void)aux;
+	free(hash);
+}
+
+static void blake3_init(void *aux, void *hash) {
+	struct blake3 *ctx = hash;
+	(void)aux;
+
+	newchunk(ctx, 0);
+	ctx->nstack = 0;
+}
+
+static void blake3_update(void *aux, void *hash, const unsigned char *buf,
+                          size_t sz) {
+	struct blake3 *ctx = hash;
+	unsigned char out[16 * 32];
+	uint32_t cv[8];
+	size_t n;
+	int i;
+	(void)aux;
+
+	while (sz) {
+		/* a full chunk is only closed off once more input shows it
+		 * isn't the last, which would be the root */
+		if (ctx->blocks * BLOCK + ctx->fill == CHUNK) {
+			compress_bytes(ctx->cv, ctx->buf, ctx->chunk, BLOCK,
+			               CHUNK_END);
+			push(ctx, ctx->cv, ctx->chunk + 1);
+			newchunk(ctx, ctx->chunk + 1);
+		}
+		if (lanes && !ctx->blocks && !ctx->fill &&
+		    sz > (size_t)lanes * CHUNK) {
+			chunks(buf, CHUNK, CHUNK, ctx->chunk, 1, 0, out);
+			for (i = 0; i < lanes; i++) {
+				words(cv, out + 32 * i);
+				push(ctx, cv, ctx->chunk + i + 1);
+			}
+			newchunk(ctx, ctx->chunk + lanes);
+			buf += lanes * CHUNK;
+			sz -= lanes * CHUNK;
+			continue;
+		}
+		if (ctx->fill == BLOCK) {
+			compress_bytes(ctx->cv, ctx->buf, ctx->chunk, BLOCK,
+			               ctx->blocks ? 0 : CHUNK_START);
+			ctx->blocks++;
+			ctx->fill = 0;
+		}
+		while (!ctx->fill && sz > BLOCK &&
+		       (ctx->blocks + 1) * BLOCK < CHUNK) {
+			compress_bytes(ctx->cv, buf, ctx->chunk, BLOCK,
+			               ctx->blocks ? 0 : CHUNK_START);
+			ctx->blocks++;
+			buf += BLOCK;
+			sz -= BLOCK;
+		}
+		n = BLOCK - ctx->fill < sz ? BLOCK - ctx->fill : sz;
+		memcpy(ctx->buf + ctx->fill, buf, n);
+		ctx->fill += n;
+		buf += n;
+		sz -= n;
+	}
+}
+
+static void blake3_final(void *aux, void *hash, unsigned char *hashbuf) {
+	struct blake3 *ctx = hash;
+	uint32_t cv[8];
+	int i;
+	(void)aux;
+
+	memset(ctx->buf + ctx->fill, 0, BLOCK - ctx->fill);
+	memcpy(cv, ctx->cv, 32);
+	compress_bytes(cv, ctx->buf, ctx->chunk, ctx->fill,
+	               (ctx->blocks ? 0 : CHUNK_START) | CHUNK_END |
+	               (ctx->nstack ? 0 : ROOT));
+	for (i = ctx->nstack - 1; i >= 0; i--)
+		parent(cv, ctx->stack[i], i ? 0 : ROOT);
+	for (i = 0; i < 8; i++)
+		put32(hashbuf + 4 * i, cv[i]);
+}
+
+/* A group of lanes leaves of sz bytes each, walked through their chunks side
+ * by side. */
+static void batch_lanes(const unsigned char *buf, size_t sz,
+                        unsigned char *out) {
+	struct blake3 ctx[16];
+	size_t nchunks = (sz + CHUNK - 1) / CHUNK, c, len;
+	unsigned char cvs[16 * 32];
+	uint32_t cv[8];
+	int i, j;
+
+	if (nchunks == 1) {
+		chunks(buf, sz, sz, 0, 0, ROOT, out);
+		return;
+	}
+	for (j = 0; j < lanes; j++)
+		ctx[j].nstack = 0;
+	for (c = 0; c < nchunks; c++) {
+		len = sz - c * CHUNK < CHUNK ? sz - c * CHUNK : CHUNK;
+		chunks(buf + c * CHUNK, sz, len, c, 0, 0, cvs);
+		for (j = 0; j < lanes; j++) {
+			words(cv, cvs + 32 * j);
+			if (c < nchunks - 1) {
+				push(&ctx[j], cv, c + 1);
+				continue;
+			}
+			for (i = ctx[j].nstack - 1; i >= 0; i--)
+				parent(cv, ctx[j].stack[i], i ? 0 : ROOT);
+			for (i = 0; i < 8; i++)
+				put32(out + 32 * j + 4 * i, cv[i]);
+		}
+	}
+}
+
+static void blake3_batch(void *aux, void *hash, const unsigned char *buf,
+                         size_t sz, size_t n, unsigned char *out) {
+	/* lanes gather from buf + i*sz with 32-bit offsets */
+	for (; lanes && sz && sz <= INT_MAX / 16 && n >= (size_t)lanes;
+	     n -= lanes) {
+		batch_lanes(buf, sz, out);
+		buf += lanes * sz;
+		out += lanes * 32;
+	}
+	for (; n; n--) {
+		blake3_init(aux, hash);
+		blake3_update(aux, hash, buf, sz);
+		blake3_final(aux, hash, out);
+		buf += sz;
+		out += 32;
+	}
+}
+
+struct hasher blake3_hasher = {
+	.new = blake3_new,
+	.free = blake3_free,
+	.init = blake3_init,
+	.update = blake3_update,
+	.final = blake3_final,
+	.batch = blake3_batch,
+	.size = 32,
+	.aux = NULL,
+	.name = "blake3"
+};
@@ -0,0 +1,422 @@
+/* httpd-bench.c - closed-loop load generator for httpd.
+ * Run as: httpd-bench [-a addr] [-p port] [-c conns] [-d secs] [-k]
+ *                     [-f size:weight,...] [-i pct] [-x pct] [-g root]
+ * Each of the conns connections keeps exactly one request outstanding. Static
+ * requests pick /bench/<size> by weight, -i percent go to the /bench/ index
+ * and -x percent to the /bench/cgi script. -g root writes that fixture into
+ * httpd's docroot and exits. Results are printed as one line of key=value
+ * pairs, so runs can be diffed or fed to a script.
+ *
+ * Only complete 200 responses count as requests and give latency samples;
+ * other statuses, resets and short bodies count as errors. With -k, a kept
+ * connection the server closes (Connection: close, or shut before answering
+ * the next request) is reopened without counting an error.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RESPBUFMAX 65536
+#define MIXMAX 16
+
+struct conn {
+	int fd;
+	int keep;		/* server left the connection open */
+	int reused;		/* this request went out on a kept connection */
+	int ok;			/* the response is a 200 */
+	int closing;		/* the response said Connection: close */
+	uint64_t start;
+	size_t got;		/* bytes of response read so far */
+	size_t hdrlen;		/* 0 until the header is complete */
+	long long bodylen;	/* -1 means read until close */
+	char hdr[1024];
+	size_t hdrfill;
+};
+
+static struct {
+	long long size;
+	int weight;
+} mix[MIXMAX];
+static int nmix;
+static int mixtotal;
+
+static struct sockaddr_in target;
+static int keepalive;
+static int idxpct;
+static int cgipct;
+
+static uint32_t *lat;
+static size_t nlat;
+static size_t latsize;
+static uint64_t bytes;
+static uint64_t errors;
+static uint64_t connects;
+
+static void udie(const char *prefix) {
+	perror(prefix);
+	exit(1);
+}
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long long parsesize(const char *s) {
+	char *end;
+	long long n = strtoll(s, &end, 10);
+	switch (*end) {
+	case 'k': case 'K':
+		return n << 10;
+	case 'm': case 'M':
+		return n << 20;
+	default:
+		return n;
+	}
+}
+
+static void parsemix(char *spec) {
+	char *tok;
+	char *w;
+
+	nmix = 0;
+	mixtotal = 0;
+	for (tok = strtok(spec, ","); tok && nmix < MIXMAX;
+	     tok = strtok(NULL, ",")) {
+		w = strchr(tok, ':');
+		mix[nmix].size = parsesize(tok);
+		mix[nmix].weight = w ? atoi(w + 1) : 1;
+		if (mix[nmix].weight <= 0) {
+			fprintf(stderr, "bad weight: %s\n", tok);
+			exit(1);
+		}
+		mixtotal += mix[nmix].weight;
+		nmix++;
+	}
+}
+
+static void genfixture(const char *root) {
+	char path[4096];
+	char buf[4096];
+	long long left;
+	size_t n;
+	int i;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/bench", root);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		udie("mkdir()");
+	memset(buf, 'x', sizeof(buf));
+	for (i = 0; i < nmix; i++) {
+		snprintf(path, sizeof(path), "%s/bench/%lld", root, mix[i].size);
+		if (!(f = fopen(path, "w")))
+			udie("fopen()");
+		for (left = mix[i].size; left > 0; left -= n) {
+			n = left < (long long)sizeof(buf) ? (size_t)left : sizeof(buf);
+			fwrite(buf, 1, n, f);
+		}
+		fclose(f);
+	}
+	snprintf(path, sizeof(path), "%s/bench/cgi", root);
+	if (!(f = fopen(path, "w")))
+		udie("fopen()");
+	fprintf(f, "#!/bin/sh\necho 'Content-Type: text/plain'\necho\necho ok\n");
+	fclose(f);
+	chmod(path, 0755);
+}
+
+static void pickurl(char *buf, size_t len) {
+	int r = rand() % 100;
+	int i;
+
+	if (r < idxpct) {
+		snprintf(buf, len, "/bench/");
+		return;
+	}
+	if (r < idxpct + cgipct) {
+		snprintf(buf, len, "/bench/cgi");
+		return;
+	}
+	r = rand() % mixtotal;
+	for (i = 0; r >= mix[i].weight; i++)
+		r -= mix[i].weight;
+	snprintf(buf, len, "/bench/%lld", mix[i].size);
+}
+
+static void record(uint64_t us) {
+	if (nlat == latsize) {
+		latsize = latsize ? latsize * 2 : 65536;
+		lat = realloc(lat, latsize * sizeof(*lat));
+		if (!lat)
+			abort();
+	}
+	lat[nlat++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static void conn_open(int epfd, struct conn *c) {
+	struct epoll_event evt;
+	int one = 1;
+
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (c->fd < 0)
+		udie("socket()");
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (struct sockaddr *)&target, sizeof(target)) < 0 &&
+	    errno != EINPROGRESS)
+		udie("connect()");
+	c->keep = 0;
+	c->reused = 0;
+	connects++;
+	evt.events = EPOLLOUT;
+	evt.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &evt) < 0)
+		udie("epoll_ctl()");
+}
+
+static void conn_close(int epfd, struct conn *c) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+}
+
+/* A kept connection the server dropped before answering is simply reopened;
+ * anything else that ends a request early is an error. */
+static void conn_fail(int epfd, struct conn *c) {
+	if (!c->reused || c->got)
+		errors++;
+	conn_close(epfd, c);
+	conn_open(epfd, c);
+}
+
+/* Requests are tiny, so a connected socket always takes one whole. */
+static void conn_send(int epfd, struct conn *c) {
+	struct epoll_event evt;
+	char url[64];
+	char req[256];
+	int n;
+
+	pickurl(url, sizeof(url));
+	n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: bench\r\n%s\r\n",
+	             url, keepalive ? "Connection: keep-alive\r\n" : "");
+	c->start = now_us();
+	c->got = 0;
+	c->hdrlen = 0;
+	c->hdrfill = 0;
+	c->bodylen = -1;
+	c->ok = 0;
+	c->closing = 0;
+	if (send(c->fd, req, n, MSG_NOSIGNAL) != n) {
+		conn_fail(epfd, c);
+		return;
+	}
+	evt.events = EPOLLIN;
+	evt.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &evt) < 0)
+		udie("epoll_ctl()");
+}
+
+static void parsehdr(struct conn *c) {
+	char *end;
+	char *cl;
+
+	c->hdr[c->hdrfill < sizeof(c->hdr) ? c->hdrfill : sizeof(c->hdr) - 1] = 0;
+	/* cgi scripts often end their header lines with a bare \n */
+	if ((end = strstr(c->hdr, "\r\n\r\n")))
+		c->hdrlen = end + 4 - c->hdr;
+	else if ((end = strstr(c->hdr, "\n\n")))
+		c->hdrlen = end + 2 - c->hdr;
+	else
+		return;
+	if ((cl = strcasestr(c->hdr, "\r\nContent-Length:")) && cl < end)
+		c->bodylen = atoll(cl + strlen("\r\nContent-Length:"));
+	if ((cl = strcasestr(c->hdr, "\r\nConnection: close")) && cl < end)
+		c->closing = 1;
+	c->ok = !strncmp(c->hdr, "HTTP/1.1 200", 12);
+}
+
+/* Runs once a whole response is in. */
+static void done(int epfd, struct conn *c) {
+	if (c->ok)
+		record(now_us() - c->start);
+	else
+		errors++;
+	bytes += c->got;
+	if (!keepalive || !c->keep || c->closing) {
+		conn_close(epfd, c);
+		conn_open(epfd, c);
+	} else {
+		c->reused = 1;
+		conn_send(epfd, c);
+	}
+}
+
+static void conn_read(int epfd, struct conn *c) {
+	static char buf[RESPBUFMAX];
+	ssize_t len;
+	size_t n;
+
+	len = read(c->fd, buf, sizeof(buf));
+	if (len < 0 && errno == EAGAIN)
+		return;
+	if (len == 0 && c->hdrlen && c->bodylen < 0) {
+		/* the body ran to the close */
+		c->keep = 0;
+		done(epfd, c);
+		return;
+	}
+	if (len <= 0) {
+		conn_fail(epfd, c);
+		return;
+	}
+	if (!c->hdrlen && c->hdrfill < sizeof(c->hdr) - 1) {
+		n = sizeof(c->hdr) - 1 - c->hdrfill;
+		n = (size_t)len < n ? (size_t)len : n;
+		memcpy(c->hdr + c->hdrfill, buf, n);
+		c->hdrfill += n;
+		parsehdr(c);
+	}
+	c->got += len;
+	if (c->hdrlen && c->bodylen >= 0 &&
+	    c->got >= c->hdrlen + (size_t)c->bodylen) {
+		c->keep = 1;
+		done(epfd, c);
+	}
+}
+
+static int cmplat(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t pct(double p) {
+	size_t i = p * nlat;
+	if (!nlat)
+		return 0;
+	return lat[i < nlat ? i : nlat - 1];
+}
+
+static void usage(const char *progn) {
+	printf("Usage: %s [-a addr] [-p port] [-c conns] [-d secs] [-k]\n"
+	       "       [-f size:weight,...] [-i pct] [-x pct] [-g root]\n", progn);
+}
+
+int main(int argc, char *argv[]) {
+	struct epoll_event evts[64];
+	struct conn *conns;
+	const char *addr = "127.0.0.1";
+	const char *root = NULL;
+	char defmix[] = "1k:60,16k:30,1m:10";
+	int port = 80;
+	int nconns = 16;
+	int secs = 10;
+	uint64_t start, end;
+	double elapsed;
+	struct conn *c;
+	int epfd;
+	int opt;
+	int i, n;
+
+	parsemix(defmix);
+	while ((opt = getopt(argc, argv, "a:p:c:d:kf:i:x:g:")) != -1) {
+		switch (opt) {
+			case 'a':
+				addr = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'c':
+				nconns = atoi(optarg);
+				break;
+			case 'd':
+				secs = atoi(optarg);
+				break;
+			case 'k':
+				keepalive = 1;
+				break;
+			case 'f':
+				parsemix(optarg);
+				break;
+			case 'i':
+				idxpct = atoi(optarg);
+				break;
+			case 'x':
+				cgipct = atoi(optarg);
+				break;
+			case 'g':
+				root = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if (!nmix || !mixtotal || nconns < 1 || idxpct + cgipct > 100) {
+		usage(argv[0]);
+		exit(1);
+	}
+	if (root) {
+		genfixture(root);
+		return 0;
+	}
+
+	memset(&target, 0, sizeof(target));
+	target.sin_family = AF_INET;
+	target.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &target.sin_addr) != 1) {
+		fprintf(stderr, "bad address: %s\n", addr);
+		exit(1);
+	}
+
+	epfd = epoll_create1(0);
+	if (epfd < 0)
+		udie("epoll_create1()");
+	conns = calloc(nconns, sizeof(*conns));
+	if (!conns)
+		abort();
+	for (i = 0; i < nconns; i++)
+		conn_open(epfd, &conns[i]);
+
+	start = now_us();
+	end = start + (uint64_t)secs * 1000000;
+	while (now_us() < end) {
+		n = epoll_wait(epfd, evts, sizeof(evts) / sizeof(evts[0]), 100);
+		if (n < 0 && errno != EINTR)
+			udie("epoll_wait()");
+		for (i = 0; i < n; i++) {
+			c = evts[i].data.ptr;
+			if (evts[i].events & EPOLLIN)
+				conn_read(epfd, c);
+			else if (evts[i].events & EPOLLERR)
+				conn_fail(epfd, c);
+			else if (evts[i].events & EPOLLOUT)
+				conn_send(epfd, c);
+		}
+	}
+	elapsed = (now_us() - start) / 1e6;
+
+	qsort(lat, nlat, sizeof(*lat), cmplat);
+	printf("conns=%d secs=%.3f keepalive=%d reqs=%zu errors=%llu "
+	       "connects=%llu rps=%.1f mbps=%.3f p50_us=%u p90_us=%u "
+	       "p99_us=%u p999_us=%u max_us=%u\n",
+	       nconns, elapsed, keepalive, nlat, (unsigned long long)errors,
+	       (unsigned long long)connects, nlat / elapsed,
+	       bytes / elapsed / (1 << 20), pct(0.5), pct(0.9), pct(0.99),
+	       pct(0.999), nlat ? lat[nlat - 1] : 0);
+	return 0;
+}
@@ -1,9 +1,17 @@
-/* httpd.c - multi-client httpd, with cgi and dirindex support, in <500 LOC.
- * Run as: httpd [-p port] <root>
+/* httpd.c - multi-client httpd, with cgi and dirindex support, in <1000 LOC.
+ * Run as: httpd [-p port] [-s tlsport -C cert [-K key]] [-m max] [-M total]
+ *               <root>
  * u+x or g+x files are considered cgi programs.
+ * Static files of up to max bytes are kept mapped, next to their response
+ * header, in a cache of at most total bytes; -m 0 turns it off. SIGUSR1 dumps
+ * the cache counters to stderr.
+ * TLS handshakes are done by OpenSSL; record encryption is then handed to the
+ * kernel (kTLS) when it will take it, so static files still go out through
+ * sendfile().
  */
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <netinet/in.h>
@@ -13,17 +21,31 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
 #define LINEBUFMAX 4096
 #define REQBUFMAX 4096
+#define RESPBUFMAX 4096
 #define FILEBUFMAX 4096
+#define SLABOBJS 64
+#define HOTBUCKETS 256
+#define HOTHDRMAX 64
+#define SENDFILEMAX (1 << 20)
+#define TLSCACHEMAX 1024
 
 static const char *docroot;
 static int printreqs = 0;
+static SSL_CTX *tlsctx;
+static volatile sig_atomic_t dumpstats = 0;
 
 struct reactor {
 	int epfd;
@@ -37,6 +59,9 @@ struct socket {
 	void (*write)(struct socket *);
 	void (*close)(struct socket *);
 	void *priv;
+
+	SSL *ssl;
+	int ktls;	/* kernel encrypts our writes; plain write() is ok */
 };
 
 struct client {
@@ -47,16 +72,68 @@ struct client {
 	char *rbuf;
 	size_t rbufsize;
 	size_t rbuffill;
+	size_t rbufpos;	/* start of the next unparsed line */
+	size_t rbufkeep;	/* the request line, which method and url point into */
 	char *wbuf;
 	size_t wbufsize;
 	size_t wbuffill;
 
+	/* both point into rbuf, which isn't compacted while a request is
+	 * being parsed */
 	char *reqmethod;
 	char *requrl;
 
 	int fillfd;
+
+	struct hotfile *hot;
+	size_t hotoff;
+};
+
+/* A cached file. The cache holds one reference and every response being
+ * written from it holds another, so eviction never pulls the mapping out from
+ * under a slow client. */
+struct hotfile {
+	struct hotfile *next;
+	struct hotfile *lruprev;
+	struct hotfile *lrunext;
+	int refs;
+
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;	/* changes with mode and owner too */
+	off_t size;
+	char *body;
+	char hdr[HOTHDRMAX];
+	size_t hdrlen;
+	char path[];
 };
 
+static struct {
+	size_t maxfile;
+	size_t maxtotal;
+	size_t total;
+	struct hotfile *buckets[HOTBUCKETS];
+	struct hotfile *lruhead;
+	struct hotfile *lrutail;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} hot = { .maxfile = 64 << 10, .maxtotal = 64 << 20 };
+
+/* Fixed-size objects are carved out of slabs and recycled through a free
+ * list, so once the pools have warmed up, serving a request costs no trips to
+ * malloc. Nothing goes back to the heap. */
+struct pool {
+	size_t size;
+	void *free;
+};
+
+static struct pool socketpool = { sizeof(struct socket), NULL };
+static struct pool clientpool = { sizeof(struct client), NULL };
+static struct pool reqbufpool = { REQBUFMAX, NULL };
+static struct pool respbufpool = { RESPBUFMAX, NULL };
+
 static void udie(const char *prefix) {
 	perror(prefix);
 	abort();
@@ -70,11 +147,24 @@ static void *xmalloc(size_t sz) {
 	return p;
 }
 
-static char *xstrdup(const char *s) {
-	char *n = strdup(s);
-	if (!n)
-		abort();
-	return n;
+static void pool_put(struct pool *p, void *obj) {
+	*(void **)obj = p->free;
+	p->free = obj;
+}
+
+static void *pool_get(struct pool *p) {
+	char *slab;
+	void *obj;
+	int i;
+
+	if (!p->free) {
+		slab = xmalloc(p->size * SLABOBJS);
+		for (i = 0; i < SLABOBJS; i++)
+			pool_put(p, slab + i * p->size);
+	}
+	obj = p->free;
+	p->free = *(void **)obj;
+	return obj;
 }
 
 static void strlcpy(char *dest, const char *src, size_t n) {
@@ -87,6 +177,51 @@ static void strlcat(char *dest, const char *src, size_t n) {
 	dest[n - 1] = '\0';
 }
 
+/* A TLS connection that has gone bad is shut down rather than torn down here;
+ * the resulting hangup reaches the reactor and takes the normal close path. */
+static ssize_t tls_fail(struct socket *s) {
+	ERR_clear_error();
+	shutdown(s->fd, SHUT_RDWR);
+	errno = EAGAIN;
+	return -1;
+}
+
+static ssize_t sock_read(struct socket *s, void *buf, size_t len) {
+	int n;
+
+	if (!s->ssl)
+		return read(s->fd, buf, len);
+	n = SSL_read(s->ssl, buf, len);
+	if (n > 0)
+		return n;
+	switch (SSL_get_error(s->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	default:
+		return tls_fail(s);
+	}
+}
+
+static ssize_t sock_write(struct socket *s, const void *buf, size_t len) {
+	int n;
+
+	if (!s->ssl || s->ktls)
+		return write(s->fd, buf, len);
+	n = SSL_write(s->ssl, buf, len);
+	if (n > 0)
+		return n;
+	switch (SSL_get_error(s->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	default:
+		return tls_fail(s);
+	}
+}
+
 static struct reactor *reactor_new(void) {
 	struct reactor *r = xmalloc(sizeof *r);
 	r->epfd = epoll_create1(0);
@@ -96,9 +231,10 @@ static struct reactor *reactor_new(void) {
 }
 
 static struct socket *reactor_add(struct reactor *r, int fd) {
-	struct socket *s = xmalloc(sizeof *s);
+	struct socket *s = pool_get(&socketpool);
 	struct epoll_event evt;
 
+	memset(s, 0, sizeof(*s));
 	s->fd = fd;
 	s->r = r;
 	evt.events = 0;
@@ -125,7 +261,8 @@ static void reactor_refresh(struct reactor *r, struct socket *s) {
 static void reactor_del(struct reactor *r, struct socket *s) {
 	if (epoll_ctl(r->epfd, EPOLL_CTL_DEL, s->fd, NULL) < 0)
 		udie("epoll_ctl()");
-	free(s);
+	close(s->fd);
+	pool_put(&socketpool, s);
 }
 
 static void reactor_run(struct reactor *r) {
@@ -135,6 +272,8 @@ static void reactor_run(struct reactor *r) {
 	struct socket *s;
 
 	n = epoll_wait(r->epfd, evts, sizeof(evts) / sizeof(evts[0]), -1);
+	if (n < 0 && errno == EINTR)
+		return;
 	if (n < 0)
 		udie("epoll_wait()");
 	for (i = 0; i < n; i++) {
@@ -154,36 +293,62 @@ static void reactor_run(struct reactor *r) {
 static void reqline(struct client *, char *);
 
 static struct client *client_new(struct socket *s) {
-	struct client *c = xmalloc(sizeof *c);
+	struct client *c = pool_get(&clientpool);
 	c->s = s;
-	c->rbuf = xmalloc(REQBUFMAX);
+	c->rbuf = pool_get(&reqbufpool);
 	c->rbufsize = REQBUFMAX;
 	c->rbuffill = 0;
+	c->rbufpos = 0;
+	c->rbufkeep = 0;
 	c->line = reqline;
+	c->wbuf = NULL;
 	c->wbufsize = 0;
 	c->wbuffill = 0;
 	c->writedone = NULL;
+	c->reqmethod = NULL;
+	c->requrl = NULL;
+	c->fillfd = -1;
+	c->hot = NULL;
 	return c;
 }
 
+static void error(struct client *c, int code);
+
 static void client_read(struct socket *s) {
 	struct client *c = s->priv;
+	char *line;
 	char *p;
 	ssize_t len;
 
-	len = read(s->fd, c->rbuf + c->rbuffill, c->rbufsize - c->rbuffill);
+	/* once the request has been taken, anything else is ignored */
+	if (!c->line)
+		c->rbuffill = c->rbufpos = 0;
+	len = sock_read(s, c->rbuf + c->rbuffill, c->rbufsize - c->rbuffill);
+	if (len < 0 && errno == EAGAIN)
+		return;
 	if (len < 0)
 		udie("read()");
 	c->rbuffill += len;
-	while ((p = strstr(c->rbuf, "\n"))) {
+	while (c->line && (p = memchr(c->rbuf + c->rbufpos, '\n',
+	                              c->rbuffill - c->rbufpos))) {
+		line = c->rbuf + c->rbufpos;
 		*p = '\0';
-		if (p > c->rbuf && p[-1] == '\r')
+		if (p > line && p[-1] == '\r')
 			p[-1] = '\0';
-		p++;
-		c->line(c, c->rbuf);
-		memmove(c->rbuf, p, c->rbufsize - (p - c->rbuf));
-		c->rbuffill -= (p - c->rbuf);
-		memset(c->rbuf + c->rbuffill, 0, c->rbufsize - c->rbuffill);
+		c->rbufpos = p + 1 - c->rbuf;
+		c->line(c, line);
+	}
+	/* header lines are dropped once parsed, so only a single line that
+	 * won't fit is too large */
+	if (c->line && c->rbufpos > c->rbufkeep) {
+		memmove(c->rbuf + c->rbufkeep, c->rbuf + c->rbufpos,
+		        c->rbuffill - c->rbufpos);
+		c->rbuffill -= c->rbufpos - c->rbufkeep;
+		c->rbufpos = c->rbufkeep;
+	}
+	if (c->line && c->rbuffill == c->rbufsize) {
+		c->line = NULL;
+		error(c, 413);
 	}
 }
 
@@ -191,7 +356,9 @@ static void client_write(struct socket *s) {
 	struct client *c = s->priv;
 	ssize_t len;
 
-	len = write(s->fd, c->wbuf, c->wbuffill);
+	len = sock_write(s, c->wbuf, c->wbuffill);
+	if (len < 0 && errno == EAGAIN)
+		return;
 	if (len < 0)
 		udie("write()");
 	if ((size_t)len < c->wbuffill)
@@ -199,18 +366,34 @@ static void client_write(struct socket *s) {
 	c->wbuffill -= len;
 	if (c->wbuffill)
 		return;
-	free(c->wbuf);
-	c->wbuf = NULL;
-	c->wbufsize = 0;
 	s->write = NULL;
 	c->writedone(c);
 }
 
+static void client_freewbuf(struct client *c) {
+	if (c->wbufsize == RESPBUFMAX)
+		pool_put(&respbufpool, c->wbuf);
+	else
+		free(c->wbuf);
+}
+
+/* Responses start out in a pooled buffer; only the rare one that outgrows it
+ * (a big directory index) moves to the heap. */
 static void client_writeb(struct client *c, const char *buf, size_t len) {
-	if (!c->wbufsize || c->wbufsize - c->wbuffill < len) {
-		size_t growby = len - (c->wbufsize - c->wbuffill);
-		c->wbuf = realloc(c->wbuf, c->wbufsize + growby);
-		c->wbufsize += growby;
+	char *nbuf;
+	size_t nsize;
+
+	if (!c->wbuf) {
+		c->wbuf = pool_get(&respbufpool);
+		c->wbufsize = RESPBUFMAX;
+	}
+	if (c->wbufsize - c->wbuffill < len) {
+		nsize = 2 * (c->wbuffill + len);
+		nbuf = xmalloc(nsize);
+		memcpy(nbuf, c->wbuf, c->wbuffill);
+		client_freewbuf(c);
+		c->wbuf = nbuf;
+		c->wbufsize = nsize;
 	}
 	memcpy(c->wbuf + c->wbuffill, buf, len);
 	c->wbuffill += len;
@@ -238,7 +421,9 @@ static void client_writeln(struct client *c, const char *fmt, ...) {
 }
 
 static void client_writedone(struct client *c) {
-	close(c->s->fd);
+	struct socket *s = c->s;
+	s->close(s);
+	reactor_del(s->r, s);
 }
 
 static void client_refillbuf(struct client *c) {
@@ -251,19 +436,220 @@ static void client_refillbuf(struct client *c) {
 	if (len == 0) {
 		c->writedone = client_writedone;
 		close(c->fillfd);
+		c->fillfd = -1;
 	} else {
 		c->writedone = client_refillbuf;
 	}
 	client_writeb(c, buf, len);
 }
 
+static void client_sendfile(struct socket *s) {
+	struct client *c = s->priv;
+	ssize_t len;
+
+	len = sendfile(s->fd, c->fillfd, NULL, SENDFILEMAX);
+	if (len < 0 && errno == EAGAIN)
+		return;
+	if (len < 0)
+		udie("sendfile()");
+	if (len > 0)
+		return;
+	close(c->fillfd);
+	c->fillfd = -1;
+	s->write = NULL;
+	client_writedone(c);
+}
+
+/* Runs once the response header has drained; the body then goes straight from
+ * the page cache to the socket. */
+static void client_startsendfile(struct client *c) {
+	c->s->write = client_sendfile;
+	reactor_refresh(c->s->r, c->s);
+}
+
+static unsigned hot_hash(const char *path) {
+	unsigned h = 2166136261u;
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h % HOTBUCKETS;
+}
+
+static void hot_unref(struct hotfile *h) {
+	if (--h->refs)
+		return;
+	if (h->size)
+		munmap(h->body, h->size);
+	free(h);
+}
+
+static void hot_lruunlink(struct hotfile *h) {
+	if (h->lruprev)
+		h->lruprev->lrunext = h->lrunext;
+	else
+		hot.lruhead = h->lrunext;
+	if (h->lrunext)
+		h->lrunext->lruprev = h->lruprev;
+	else
+		hot.lrutail = h->lruprev;
+}
+
+static void hot_lrupush(struct hotfile *h) {
+	h->lruprev = NULL;
+	h->lrunext = hot.lruhead;
+	if (hot.lruhead)
+		hot.lruhead->lruprev = h;
+	else
+		hot.lrutail = h;
+	hot.lruhead = h;
+}
+
+static void hot_evict(struct hotfile *h) {
+	struct hotfile **pp = &hot.buckets[hot_hash(h->path)];
+	while (*pp != h)
+		pp = &(*pp)->next;
+	*pp = h->next;
+	hot_lruunlink(h);
+	hot.total -= h->size;
+	hot.evictions++;
+	hot_unref(h);
+}
+
+/* Evicts h if a lookup hasn't already. */
+static void hot_drop(struct hotfile *h) {
+	struct hotfile *e;
+
+	for (e = hot.buckets[hot_hash(h->path)]; e; e = e->next)
+		if (e == h) {
+			hot_evict(h);
+			return;
+		}
+}
+
+/* Revalidates against the file's current inode, mtime and ctime (so a chmod
+ * or chown drops the entry too), which costs a stat() but no open or read. */
+static struct hotfile *hot_lookup(const char *path) {
+	struct hotfile *h;
+	struct stat st;
+
+	for (h = hot.buckets[hot_hash(path)]; h; h = h->next)
+		if (!strcmp(h->path, path))
+			break;
+	if (!h)
+		return NULL;
+	if (stat(path, &st) == -1 || st.st_dev != h->dev ||
+	    st.st_ino != h->ino || st.st_size != h->size ||
+	    st.st_mtim.tv_sec != h->mtime.tv_sec ||
+	    st.st_mtim.tv_nsec != h->mtime.tv_nsec ||
+	    st.st_ctim.tv_sec != h->ctime.tv_sec ||
+	    st.st_ctim.tv_nsec != h->ctime.tv_nsec ||
+	    (st.st_mode & (S_IXUSR | S_IXGRP))) {
+		hot_evict(h);
+		return NULL;
+	}
+	hot_lruunlink(h);
+	hot_lrupush(h);
+	hot.hits++;
+	return h;
+}
+
+static struct hotfile *hot_insert(const char *path, int fd, struct stat *st) {
+	struct hotfile *h;
+	unsigned b;
+
+	if ((size_t)st->st_size > hot.maxfile ||
+	    (size_t)st->st_size > hot.maxtotal)
+		return NULL;
+	hot.misses++;
+	h = xmalloc(sizeof(*h) + strlen(path) + 1);
+	if (st->st_size) {
+		h->body = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (h->body == MAP_FAILED) {
+			free(h);
+			return NULL;
+		}
+	}
+	strcpy(h->path, path);
+	h->refs = 1;
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->mtime = st->st_mtim;
+	h->ctime = st->st_ctim;
+	h->size = st->st_size;
+	h->hdrlen = snprintf(h->hdr, sizeof(h->hdr),
+	                     "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n\r\n",
+	                     (long long)st->st_size);
+
+	while (hot.total + h->size > hot.maxtotal)
+		hot_evict(hot.lrutail);
+	b = hot_hash(path);
+	h->next = hot.buckets[b];
+	hot.buckets[b] = h;
+	hot_lrupush(h);
+	hot.total += h->size;
+	return h;
+}
+
+static void hot_dump(void) {
+	fprintf(stderr, "hot: hits=%lu misses=%lu evictions=%lu bytes=%zu\n",
+	        hot.hits, hot.misses, hot.evictions, hot.total);
+}
+
+static void client_writehot(struct socket *s) {
+	struct client *c = s->priv;
+	struct hotfile *h = c->hot;
+	struct iovec iov[2];
+	size_t off;
+	ssize_t len;
+	int n = 0;
+
+	if (c->hotoff < h->hdrlen) {
+		iov[n].iov_base = h->hdr + c->hotoff;
+		iov[n++].iov_len = h->hdrlen - c->hotoff;
+	}
+	off = c->hotoff > h->hdrlen ? c->hotoff - h->hdrlen : 0;
+	if ((size_t)h->size > off) {
+		iov[n].iov_base = h->body + off;
+		iov[n++].iov_len = h->size - off;
+	}
+	len = writev(s->fd, iov, n);
+	if (len < 0 && errno == EAGAIN)
+		return;
+	if (len < 0) {
+		/* EFAULT means the file was truncated under the mapping since
+		 * it was last looked up; the entry is stale, but only this
+		 * connection is lost */
+		if (errno == EFAULT)
+			hot_drop(h);
+		client_writedone(c);
+		return;
+	}
+	c->hotoff += len;
+	if (c->hotoff < h->hdrlen + h->size)
+		return;
+	s->write = NULL;
+	client_writedone(c);
+}
+
+static void client_sendhot(struct client *c, struct hotfile *h) {
+	h->refs++;
+	c->hot = h;
+	c->hotoff = 0;
+	c->s->write = client_writehot;
+	reactor_refresh(c->s->r, c->s);
+}
+
 static void client_close(struct socket *s) {
 	struct client *c = s->priv;
-	free(c->reqmethod);
-	free(c->requrl);
-	free(c->rbuf);
-	free(c->wbuf);
-	free(c);
+	if (c->fillfd != -1)
+		close(c->fillfd);
+	if (c->hot)
+		hot_unref(c->hot);
+	pool_put(&reqbufpool, c->rbuf);
+	if (c->wbuf)
+		client_freewbuf(c);
+	pool_put(&clientpool, c);
+	if (s->ssl)
+		SSL_free(s->ssl);
 	/* ... */
 }
 
@@ -284,9 +670,63 @@ static void listener_read(struct socket *s) {
 	n->priv = client_new(n);
 }
 
+static void tls_handshake(struct socket *s) {
+	int n = SSL_do_handshake(s->ssl);
+
+	s->read = NULL;
+	s->write = NULL;
+	if (n == 1) {
+		s->ktls = BIO_get_ktls_send(SSL_get_wbio(s->ssl));
+		s->read = client_read;
+		s->close = client_close;
+		s->priv = client_new(s);
+	} else {
+		switch (SSL_get_error(s->ssl, n)) {
+		case SSL_ERROR_WANT_READ:
+			s->read = tls_handshake;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			s->write = tls_handshake;
+			break;
+		default:
+			tls_fail(s);
+			break;
+		}
+	}
+	reactor_refresh(s->r, s);
+}
+
+static void tls_close(struct socket *s) {
+	SSL_free(s->ssl);
+}
+
+/* TLS clients are nonblocking so that a slow handshake can't stall everyone
+ * else; plaintext clients stay blocking as they always have. */
+static void tls_listener_read(struct socket *s) {
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	int nfd = accept(s->fd, (struct sockaddr *)&sa, &salen);
+	struct socket *n;
+	if (nfd == -1)
+		udie("accept()");
+	if (fcntl(nfd, F_SETFD, FD_CLOEXEC) < 0)
+		udie("fcntl()");
+	if (fcntl(nfd, F_SETFL, O_NONBLOCK) < 0)
+		udie("fcntl()");
+	n = reactor_add(s->r, nfd);
+	memcpy(&n->sa, &sa, sizeof(n->sa));
+	n->ssl = SSL_new(tlsctx);
+	if (!n->ssl || !SSL_set_fd(n->ssl, nfd))
+		udie("SSL_new()");
+	SSL_set_accept_state(n->ssl);
+	n->close = tls_close;
+	tls_handshake(n);
+}
+
 static void error(struct client *c, int code) {
 	client_writeln(c, "HTTP/1.1 %u Error", code);
 	client_writeln(c, "");
+	c->line = NULL;
 	c->writedone = client_writedone;
 }
 
@@ -300,6 +740,8 @@ static void runcgi(struct client *c, const char *prog, const char *args) {
 	char buf[] = "REMOTE_ADDR=255.255.255.255";
 	iptobuf(c, buf + strlen("REMOTE_ADDR="));
 	putenv(buf);
+	if (c->s->ssl)
+		fcntl(c->s->fd, F_SETFL, 0);
 	dup2(c->s->fd, 0);
 	dup2(c->s->fd, 1);
 	dup2(c->s->fd, 2);
@@ -342,34 +784,39 @@ static void genindex(struct client *c, const char *url) {
 	client_writeln(c, "  </body>");
 	client_writeln(c, "</html>");
 	closedir(d);
+	c->fillfd = -1;
 	c->writedone = client_writedone;
 }
 
 static void get(struct client *c, char *url) {
 	char rp[PATH_MAX];
-	char *rpcanon;
+	char rpcanon[PATH_MAX];
 	char *rest;
 	struct stat st;
+	struct hotfile *h;
+	int plain = !c->s->ssl || c->s->ktls;
 
 	strlcpy(rp, docroot, sizeof(rp));
 	if ((rest = strchr(url, '?')))
 		*rest++ = '\0';
 	strlcat(rp, url, sizeof(rp));
-	rpcanon = realpath(rp, NULL);
-	if (!rpcanon) {
+	if (!realpath(rp, rpcanon)) {
 		error(c, 404);
 		return;
 	}
 
 	if (strstr(rpcanon, docroot) != rpcanon) {
 		error(c, 403);
-		free(rpcanon);
+		return;
+	}
+
+	if (plain && hot.maxfile && (h = hot_lookup(rpcanon))) {
+		client_sendhot(c, h);
 		return;
 	}
 
 	c->fillfd = open(rpcanon, O_RDONLY);
 	if (c->fillfd == -1) {
-		free(rpcanon);
 		error(c, 403);	/* XXX: not all open() failures are 403s */
 		return;
 	}
@@ -377,20 +824,44 @@ static void get(struct client *c, char *url) {
 	if (fstat(c->fillfd, &st) == -1)
 		udie("fstat()");
 
+	/* a cgi writes to the socket itself, which only works over TLS if the
+	 * kernel is doing the encryption */
+	if (!S_ISDIR(st.st_mode) && (st.st_mode & (S_IXUSR | S_IXGRP)) &&
+	    !plain) {
+		close(c->fillfd);
+		c->fillfd = -1;
+		error(c, 501);
+		return;
+	}
+
+	if (plain && hot.maxfile && S_ISREG(st.st_mode) &&
+	    !(st.st_mode & (S_IXUSR | S_IXGRP)) &&
+	    (h = hot_insert(rpcanon, c->fillfd, &st))) {
+		close(c->fillfd);
+		c->fillfd = -1;
+		client_sendhot(c, h);
+		return;
+	}
+
 	client_writeln(c, "HTTP/1.1 200 OK");
 
 	if (S_ISDIR(st.st_mode)) {
 		genindex(c, url);
 	} else if (st.st_mode & (S_IXUSR | S_IXGRP)) {
 		cgi(c, rpcanon, rest);
+	} else if (plain) {
+		client_writeln(c, "Content-Length: %lld", (long long)st.st_size);
+		client_writeln(c, "");
+		c->writedone = client_startsendfile;
 	} else {
+		client_writeln(c, "Content-Length: %lld", (long long)st.st_size);
 		client_writeln(c, "");
 		client_refillbuf(c);
 	}
-	free(rpcanon);
 }
 
 static void reqdone(struct client *c) {
+	c->line = NULL;
 	if (printreqs) {
 		char buf[32];
 		iptobuf(c, buf);
@@ -424,8 +895,9 @@ static void reqline(struct client *c, char *line) {
 		return;
 	}
 
-	c->reqmethod = xstrdup(method);
-	c->requrl = xstrdup(url);
+	c->reqmethod = method;
+	c->requrl = url;
+	c->rbufkeep = c->rbufpos;
 	c->line = reqhdr;
 }
 
@@ -447,8 +919,33 @@ static int serve(int port) {
 	return sfd;
 }
 
+static SSL_CTX *tls_new(const char *cert, const char *key) {
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx)
+		udie("SSL_CTX_new()");
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+	                      SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	/* resumption: a session cache for TLS 1.2 ids, tickets for 1.3 */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, TLSCACHEMAX);
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"httpd", 5);
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1) {
+		ERR_print_errors_fp(stderr);
+		exit(1);
+	}
+	return ctx;
+}
+
+static void onusr1(int sig) {
+	(void)sig;
+	dumpstats = 1;
+}
+
 static void usage(const char *progn) {
-	printf("Usage: %s [-p port] [-v] <root>\n", progn);
+	printf("Usage: %s [-p port] [-s tlsport -C cert [-K key]] "
+	       "[-m max] [-M total] [-v] <root>\n", progn);
 }
 
 int main(int argc, char *argv[]) {
@@ -456,12 +953,30 @@ int main(int argc, char *argv[]) {
 	struct socket *listener;
 	int opt;
 	int port = 80;
+	int tlsport = 0;
+	const char *cert = NULL;
+	const char *key = NULL;
 	
-	while ((opt = getopt(argc, argv, "p:v")) != -1) {
+	while ((opt = getopt(argc, argv, "p:s:C:K:m:M:v")) != -1) {
 		switch (opt) {
 			case 'p':
 				port = atoi(optarg);
 				break;
+			case 's':
+				tlsport = atoi(optarg);
+				break;
+			case 'C':
+				cert = optarg;
+				break;
+			case 'K':
+				key = optarg;
+				break;
+			case 'm':
+				hot.maxfile = strtoul(optarg, NULL, 0);
+				break;
+			case 'M':
+				hot.maxtotal = strtoul(optarg, NULL, 0);
+				break;
 			case 'v':
 				printreqs = 1;
 				break;
@@ -471,7 +986,7 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	if (optind >= argc) {
+	if (optind >= argc || (tlsport && !cert)) {
 		usage(argv[0]);
 		exit(1);
 	}
@@ -482,9 +997,22 @@ int main(int argc, char *argv[]) {
 	listener->read = listener_read;
 	reactor_refresh(r, listener);
 
+	if (tlsport) {
+		tlsctx = tls_new(cert, key ? key : cert);
+		listener = reactor_add(r, serve(tlsport));
+		listener->read = tls_listener_read;
+		reactor_refresh(r, listener);
+	}
+
 	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, onusr1);
 
 	while (1) {
 		reactor_run(r);
+		if (dumpstats) {
+			dumpstats = 0;
+			hot_dump();
+		}
 	}
 }
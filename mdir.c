@@ -0,0 +1,274 @@
+/* mdir.c - merkle roots for every file under a directory
+ * Each thread keeps a deque of paths still to look at. A thread works on the
+ * newest path in its own deque, pushing whatever a directory holds back onto
+ * it, and when it runs dry it steals the oldest path from someone else's,
+ * which tends to be a whole unexplored subtree. Directory reads, opens and
+ * hashing all happen on whichever thread gets there first. A thread that finds
+ * nothing to steal sleeps until something is pushed or the walk is over.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "merkle.h"
+
+struct task {
+	char *path;		/* relative to the top */
+	unsigned char type;	/* DT_* */
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct task *v;
+	size_t head;		/* stolen from */
+	size_t tail;		/* pushed and popped by the owner */
+	size_t cap;
+};
+
+struct walk;
+
+struct walker {
+	struct walk *w;
+	int id;
+	pthread_t thread;
+	struct deque q;
+	struct merkle *m;
+	struct merkle_entry *entries;
+	size_t nentries;
+	size_t cap;
+};
+
+struct walk {
+	int top;		/* fd of the directory being hashed */
+	int nthreads;
+	struct walker *walkers;
+	unsigned long pending;	/* tasks pushed but not finished */
+	pthread_mutex_t lock;	/* for sleeping on cond */
+	pthread_cond_t cond;
+	int sleeping;
+};
+
+static void push(struct walker *wk, char *path, unsigned char type) {
+	struct deque *q = &wk->q;
+
+	__atomic_add_fetch(&wk->w->pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->cap) {
+		memmove(q->v, q->v + q->head, (q->tail - q->head) * sizeof *q->v);
+		q->tail -= q->head;
+		q->head = 0;
+		if (q->tail == q->cap) {
+			q->cap = q->cap ? 2 * q->cap : 64;
+			if (!(q->v = realloc(q->v, q->cap * sizeof *q->v)))
+				abort();
+		}
+	}
+	q->v[q->tail].path = path;
+	q->v[q->tail++].type = type;
+	pthread_mutex_unlock(&q->lock);
+	/* a thread going to sleep counts itself before its last look at the
+	 * deques, so either it sees this task or we see it */
+	if (__atomic_load_n(&wk->w->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&wk->w->lock);
+		pthread_cond_signal(&wk->w->cond);
+		pthread_mutex_unlock(&wk->w->lock);
+	}
+}
+
+static int pop(struct deque *q, struct task *t, int steal) {
+	int r = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail > q->head) {
+		*t = steal ? q->v[q->head++] : q->v[--q->tail];
+		r = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return r;
+}
+
+static int take(struct walker *wk, struct task *t) {
+	struct walk *w = wk->w;
+	int i;
+
+	if (pop(&wk->q, t, 0))
+		return 1;
+	for (i = 1; i < w->nthreads; i++)
+		if (pop(&w->walkers[(wk->id + i) % w->nthreads].q, t, 1))
+			return 1;
+	return 0;
+}
+
+/* Like take, but waits for work; 0 means there is none left anywhere. */
+static int takewait(struct walker *wk, struct task *t) {
+	struct walk *w = wk->w;
+	int r;
+
+	if (take(wk, t))
+		return 1;
+	pthread_mutex_lock(&w->lock);
+	__atomic_add_fetch(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+	while (!(r = take(wk, t)) &&
+	       __atomic_load_n(&w->pending, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&w->cond, &w->lock);
+	__atomic_sub_fetch(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&w->lock);
+	return r;
+}
+
+static void walk_dir(struct walker *wk, struct task *t) {
+	DIR *d;
+	struct dirent *e;
+	char *path;
+	int fd;
+
+	if ((fd = openat(wk->w->top, t->path, O_RDONLY | O_DIRECTORY)) == -1 ||
+	    !(d = fdopendir(fd))) {
+		perror(t->path);
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	while ((e = readdir(d))) {
+		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+		if (!strcmp(t->path, "."))
+			path = strdup(e->d_name);
+		else if (asprintf(&path, "%s/%s", t->path, e->d_name) == -1)
+			abort();
+		push(wk, path, e->d_type);
+	}
+	closedir(d);
+}
+
+static void walk_file(struct walker *wk, struct task *t) {
+	struct merkle_entry *e;
+	struct stat st;
+	int fd;
+
+	if ((fd = openat(wk->w->top, t->path, O_RDONLY | O_NOFOLLOW)) == -1 ||
+	    fstat(fd, &st) == -1) {
+		perror(t->path);
+		goto out;
+	}
+	if (!S_ISREG(st.st_mode))
+		goto out;
+	merkle_reset(wk->m);
+	/* an empty file has nothing to map, and no use for a reader thread */
+	if (st.st_size && merkle_fd(wk->m, fd) == -1) {
+		perror(t->path);
+		goto out;
+	}
+	if (wk->nentries == wk->cap) {
+		wk->cap = wk->cap ? 2 * wk->cap : 64;
+		if (!(wk->entries = realloc(wk->entries,
+		                            wk->cap * sizeof *wk->entries)))
+			abort();
+	}
+	e = &wk->entries[wk->nentries++];
+	merkle_final(wk->m, e->root);
+	e->path = t->path;
+	e->size = st.st_size;
+	t->path = NULL;
+out:
+	if (fd != -1)
+		close(fd);
+}
+
+static void *walker_main(void *arg) {
+	struct walker *wk = arg;
+	struct walk *w = wk->w;
+	struct stat st;
+	struct task t;
+
+	while (takewait(wk, &t)) {
+		if (t.type == DT_UNKNOWN) {
+			if (fstatat(w->top, t.path, &st, AT_SYMLINK_NOFOLLOW))
+				perror(t.path);
+			else
+				t.type = S_ISDIR(st.st_mode) ? DT_DIR :
+				         S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+		}
+		if (t.type == DT_DIR)
+			walk_dir(wk, &t);
+		else if (t.type == DT_REG)
+			walk_file(wk, &t);
+		free(t.path);
+		/* the last one out wakes everyone to leave */
+		if (!__atomic_sub_fetch(&w->pending, 1, __ATOMIC_ACQ_REL)) {
+			pthread_mutex_lock(&w->lock);
+			pthread_cond_broadcast(&w->cond);
+			pthread_mutex_unlock(&w->lock);
+		}
+	}
+	return NULL;
+}
+
+static int bypath(const void *a, const void *b) {
+	return strcmp(((const struct merkle_entry *)a)->path,
+	              ((const struct merkle_entry *)b)->path);
+}
+
+/* Hashes every regular file under dir (not following symlinks) on nthreads
+ * threads. The entries come back in *entries, sorted by path, and their
+ * number is returned; -1 means dir itself couldn't be opened. Files that
+ * can't be read are reported on stderr and left out. */
+long merkle_dir(const char *dir, size_t sz, struct hasher *hasher,
+                int nthreads, struct merkle_entry **entries) {
+	struct walk w;
+	size_t n = 0;
+	int i;
+
+	if ((w.top = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+		return -1;
+	if (nthreads < 1)
+		nthreads = 1;
+	w.nthreads = nthreads;
+	w.walkers = calloc(nthreads, sizeof *w.walkers);
+	w.pending = 0;
+	w.sleeping = 0;
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	for (i = 0; i < nthreads; i++) {
+		w.walkers[i].w = &w;
+		w.walkers[i].id = i;
+		pthread_mutex_init(&w.walkers[i].q.lock, NULL);
+		w.walkers[i].m = merkle_new(sz, hasher);
+	}
+	push(&w.walkers[0], strdup("."), DT_DIR);
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&w.walkers[i].thread, NULL, walker_main,
+		                   &w.walkers[i]))
+			abort();
+	walker_main(&w.walkers[0]);
+
+	/* everyone has to be out before any deque goes, as a thread on its
+	 * way out may still look in them */
+	for (i = 1; i < nthreads; i++)
+		pthread_join(w.walkers[i].thread, NULL);
+	*entries = NULL;
+	for (i = 0; i < nthreads; i++) {
+		*entries = realloc(*entries, (n + w.walkers[i].nentries + 1) *
+		                             sizeof **entries);
+		memcpy(*entries + n, w.walkers[i].entries,
+		       w.walkers[i].nentries * sizeof **entries);
+		n += w.walkers[i].nentries;
+		free(w.walkers[i].entries);
+		free(w.walkers[i].q.v);
+		pthread_mutex_destroy(&w.walkers[i].q.lock);
+		merkle_free(w.walkers[i].m);
+	}
+	qsort(*entries, n, sizeof **entries, bypath);
+	free(w.walkers);
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.cond);
+	close(w.top);
+	return n;
+}
@@ -0,0 +1,298 @@
+/* merkle-bench.c - throughput of the merkle engine across its knobs
+ * Run as: merkle-bench [-H hash,...] [-b size,...] [-t threads,...]
+ *                      [-m megabytes] [-f file]
+ * Every combination of hasher, block size and thread count is run over the
+ * same synthetic data twice: once from memory with merkle_update(), and once
+ * through merkle_fd() on file (written first if it isn't that big already).
+ * Each run is a child process of its own, so its peak RSS and CPU time are
+ * its own. A second, instrumented pass wraps the hasher to count the CPU
+ * time spent inside it, on the calling thread's clock; the rest of that
+ * pass's CPU time (tree_s) went to the engine itself: the tree, threads and
+ * I/O. Reading a thread's clock is a system call, which makes that pass
+ * slower, so wall_s and gbps come from the plain one. Results are CSV on
+ * stdout, one row per run.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "merkle.h"
+
+#define LISTMAX 16
+#define CHUNK (1 << 20)		/* data is written out this much at a time */
+#define SEED 0x9e3779b97f4a7c15ull
+
+/* The hasher being measured, with every call timed. */
+static struct hasher *inner;
+static uint64_t hashns;
+
+static uint64_t now_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* CPU time, like cpu_s, so that a thread waiting for a core doesn't count
+ * as hashing. */
+#define TIMED(call) do { \
+	uint64_t t0 = now_ns(CLOCK_THREAD_CPUTIME_ID); \
+	call; \
+	__atomic_add_fetch(&hashns, now_ns(CLOCK_THREAD_CPUTIME_ID) - t0, \
+	                   __ATOMIC_RELAXED); \
+} while (0)
+
+static void *timed_new(void *aux) {
+	(void)aux;
+	return inner->new(inner->aux);
+}
+
+static void timed_free(void *aux, void *hash) {
+	(void)aux;
+	inner->free(inner->aux, hash);
+}
+
+static void timed_init(void *aux, void *hash) {
+	(void)aux;
+	TIMED(inner->init(inner->aux, hash));
+}
+
+static void timed_update(void *aux, void *hash, const unsigned char *buf,
+                         size_t sz) {
+	(void)aux;
+	TIMED(inner->update(inner->aux, hash, buf, sz));
+}
+
+static void timed_final(void *aux, void *hash, unsigned char *hashbuf) {
+	(void)aux;
+	TIMED(inner->final(inner->aux, hash, hashbuf));
+}
+
+static void timed_batch(void *aux, void *hash, const unsigned char *buf,
+                        size_t sz, size_t n, unsigned char *out) {
+	(void)aux;
+	TIMED(inner->batch(inner->aux, hash, buf, sz, n, out));
+}
+
+static struct hasher timed = {
+	.new = timed_new,
+	.free = timed_free,
+	.init = timed_init,
+	.update = timed_update,
+	.final = timed_final
+};
+
+static struct hasher *wrap(struct hasher *h) {
+	inner = h;
+	timed.batch = h->batch ? timed_batch : NULL;
+	timed.size = h->size;
+	timed.name = h->name;
+	return &timed;
+}
+
+/* One pass over the data, from buf if there is one and fd if not; returns
+ * the wall time in seconds. */
+static double pass(struct hasher *h, size_t bs, int nthreads,
+                   const unsigned char *buf, size_t len, int fd) {
+	struct merkle *m = merkle_new_parallel(bs, h, nthreads);
+	unsigned char root[MAXHASH];
+	uint64_t t0 = now_ns(CLOCK_MONOTONIC);
+
+	if (buf)
+		merkle_update(m, buf, len);
+	else if (lseek(fd, 0, SEEK_SET) == -1 || merkle_fd(m, fd) == -1)
+		perror("merkle_fd");
+	merkle_final(m, root);
+	t0 = now_ns(CLOCK_MONOTONIC) - t0;
+	merkle_free(m);
+	return t0 / 1e9;
+}
+
+/* The same bytes every time, so runs on different machines hash the same
+ * thing; *x carries on from one piece to the next. len is a multiple of 8. */
+static void fill(uint64_t *x, unsigned char *buf, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i += 8) {
+		*x ^= *x << 13;
+		*x ^= *x >> 7;
+		*x ^= *x << 17;
+		memcpy(buf + i, x, 8);
+	}
+}
+
+/* Runs one configuration in a child and prints its row, unless the child
+ * failed. The in-memory data is made in the child, so only those runs count
+ * it in their peak. */
+static void run(const char *data, struct hasher *h, size_t bs, int nthreads,
+                size_t len, int fd) {
+	uint64_t x = SEED;
+	unsigned char *buf = NULL;
+	struct rusage ru;
+	uint64_t cpu;
+	double res[3];		/* wall, cpu and hasher time */
+	int pipefd[2];
+	int status, ok;
+	pid_t pid;
+
+	if (pipe(pipefd) == -1 || (pid = fork()) == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (!pid) {
+		close(pipefd[0]);
+		if (fd == -1) {
+			if (!(buf = malloc(len)))
+				_exit(1);
+			fill(&x, buf, len);
+		}
+		res[0] = pass(h, bs, nthreads, buf, len, fd);
+		hashns = 0;
+		cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+		pass(wrap(h), bs, nthreads, buf, len, fd);
+		res[1] = (now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu) / 1e9;
+		res[2] = hashns / 1e9;
+		_exit(write(pipefd[1], res, sizeof res) != sizeof res);
+	}
+	close(pipefd[1]);
+	ok = read(pipefd[0], res, sizeof res) == sizeof res;
+	close(pipefd[0]);
+	if (wait4(pid, &status, 0, &ru) == -1 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status))
+		ok = 0;
+	if (!ok) {
+		fprintf(stderr, "%s,%s,%zu,%d: run failed, no row\n", data,
+		        h->name, bs, nthreads);
+		return;
+	}
+	printf("%s,%s,%zu,%d,%zu,%.4f,%.3f,%.4f,%.4f,%.4f,%ld\n", data, h->name,
+	       bs, nthreads, len, res[0], res[0] ? len / res[0] / 1e9 : 0,
+	       res[1], res[2], res[1] - res[2], ru.ru_maxrss);
+	fflush(stdout);
+}
+
+static int parselist(char *s, char **v) {
+	int n = 0;
+
+	for (s = strtok(s, ","); s && n < LISTMAX; s = strtok(NULL, ","))
+		v[n++] = s;
+	return n;
+}
+
+static int datafile(const char *path, size_t len) {
+	unsigned char *buf = malloc(CHUNK);
+	uint64_t x = SEED;
+	struct stat st;
+	size_t off;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(path);
+		exit(1);
+	}
+	if ((size_t)st.st_size != len) {
+		for (off = 0; off < len; off += CHUNK) {
+			fill(&x, buf, CHUNK);
+			if (pwrite(fd, buf, CHUNK, off) != CHUNK) {
+				perror(path);
+				exit(1);
+			}
+		}
+		if (ftruncate(fd, len) == -1) {
+			perror(path);
+			exit(1);
+		}
+	}
+	free(buf);
+	return fd;
+}
+
+static void usage(const char *progn) {
+	printf("Usage: %s [-H hash,...] [-b size,...] [-t threads,...]\n"
+	       "       [-m megabytes] [-f file]\n", progn);
+}
+
+int main(int argc, char *argv[]) {
+	char defhash[] = "sha256,sha256mb,blake3,sha512,sha1,md5";
+	char defsize[] = "1024,4096,65536";
+	char defthreads[32];
+	char *hashes[LISTMAX], *sizes[LISTMAX], *threads[LISTMAX];
+	int nhashes, nsizes, nthreads;
+	const char *path = "/tmp/merkle-bench.dat";
+	struct hasher *h;
+	size_t len = 256 << 20;
+	int fd, opt, i, j, k;
+
+	snprintf(defthreads, sizeof defthreads, "1,%ld",
+	         sysconf(_SC_NPROCESSORS_ONLN));
+	nhashes = parselist(defhash, hashes);
+	nsizes = parselist(defsize, sizes);
+	nthreads = parselist(defthreads, threads);
+	while ((opt = getopt(argc, argv, "H:b:t:m:f:")) != -1) {
+		switch (opt) {
+			case 'H':
+				nhashes = parselist(optarg, hashes);
+				break;
+			case 'b':
+				nsizes = parselist(optarg, sizes);
+				break;
+			case 't':
+				nthreads = parselist(optarg, threads);
+				break;
+			case 'm':
+				len = (size_t)atoi(optarg) << 20;
+				break;
+			case 'f':
+				path = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	for (i = 0; i < nhashes; i++)
+		if (!merkle_hasher(hashes[i])) {
+			fprintf(stderr, "unknown hash: %s\n", hashes[i]);
+			exit(1);
+		}
+	if (!len) {
+		usage(argv[0]);
+		exit(1);
+	}
+	fd = datafile(path, len);
+
+	printf("data,hasher,block,threads,bytes,wall_s,gbps,cpu_s,hasher_s,"
+	       "tree_s,peak_kb\n");
+	for (i = 0; i < nhashes; i++) {
+		h = merkle_hasher(hashes[i]);
+		for (j = 0; j < nsizes; j++) {
+			/* merkle_new wants whole hashes to a block */
+			if (atoi(sizes[j]) % h->size) {
+				fprintf(stderr, "skipping %s at %s: the block "
+				        "size isn't a multiple of %zu\n",
+				        h->name, sizes[j], h->size);
+				continue;
+			}
+			for (k = 0; k < nthreads; k++) {
+				/* the default is "1,1" on one CPU */
+				if (k && !strcmp(threads[k], threads[k - 1]))
+					continue;
+				run("mem", h, atoi(sizes[j]), atoi(threads[k]),
+				    len, -1);
+				run("file", h, atoi(sizes[j]), atoi(threads[k]),
+				    len, fd);
+			}
+		}
+	}
+	close(fd);
+	return 0;
+}
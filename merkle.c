@@ -1,97 +1,541 @@
 /* merkle.c - merkle hashing tool
- * Used like: merkle <hash type> <block size>
+ * Used like: merkle <hash type> <block size> [threads]
  * hashes stdin, emits hash (as hex) on stdout
+ * With threads > 1, leaf blocks are hashed by a pool of that many threads; the
+ * tree (and so the output) is the same either way.
+ *
+ * merkle save <hash type> <block size> <file> <tree file> [threads]
+ *   hashes file the same way and also writes out the whole tree
+ * merkle update <file> <tree file> [offset:length...]
+ *   rehashes just the blocks in the given byte ranges (or, with none, finds
+ *   the changed ones if file's mtime moved) and their ancestors, then rewrites
+ *   tree file
+ * merkle proof <tree file> <block number>
+ *   writes the audit path for one block, in binary, to stdout
+ * merkle verify <root> <proof file>
+ *   checks the block on stdin against the proof and the root (in hex)
+ * merkle diff <old tree file> <new tree file> [new file]
+ *   lists the byte ranges (offset length) of the new file whose blocks
+ *   differ, or given the new file, writes a patch with their contents
+ * merkle apply <file> [tree file]
+ *   applies the patch on stdin to file, then updates its tree
+ * merkle dir <hash type> <block size> <directory> [threads]
+ *   hashes every file under directory, printing "root size path" for each in
+ *   path order, then a root for the directory: the hash of those lines
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/evp.h>
 
 #include "merkle.h"
 
-struct merkle {
-	struct merkle *parent;
+enum {
+	BATCHMAX = 1024,	/* leaf blocks handed to the pool per round */
+	SERIALBATCH = 64,	/* ... or to hasher->batch without a pool */
+	READSIZE = 8 << 20,	/* per buffer, for input that can't be mapped */
+	PAGESIZE = 4096
+};
+
+/* A pool of threads that hashes a run of whole leaf blocks into digests. The
+ * calling thread works on the batch too, so nthreads counts it. Blocks are
+ * claimed in chunks off a shared counter; the digests land in block order no
+ * matter who hashed them. */
+struct workers;
+
+struct worker {
+	struct workers *w;
+	pthread_t thread;
+	void *hash;
+};
+
+struct workers {
+	struct hasher *hasher;
 	size_t size;
+	int nthreads;
+	struct worker *threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned long round;
+	int busy;
+	int quit;
+
+	const unsigned char *buf;
+	size_t nblocks;
+	size_t chunk;
+	size_t next;
+	unsigned char digests[BATCHMAX * MAXHASH];
+};
+
+/* Every level's state lives inline, and all of the hash contexts (one per
+ * level, plus a scratch one for batches) are set up by merkle_new(), so
+ * streaming does no allocation. */
+struct level {
+	void *hash;
 	size_t filled;
+};
+
+struct merkle {
+	size_t size;
 	struct hasher *hasher;
-	void *hash;
+	int depth;		/* levels in use; level[0] is the leaves */
+	struct level level[MAXDEPTH];
+	void *scratch;
+	struct workers *workers;	/* if parallel */
+	struct merkle_tree *tree;	/* if recording */
+	uint64_t len;
+	unsigned char digests[SERIALBATCH * MAXHASH];
 };
 
+/* Hashers without a batch entry point get one the slow way. */
+static void batch(struct hasher *h, void *hash, const unsigned char *buf,
+                  size_t sz, size_t n, unsigned char *out) {
+	if (h->batch) {
+		h->batch(h->aux, hash, buf, sz, n, out);
+		return;
+	}
+	for (; n; n--, buf += sz, out += h->size) {
+		h->init(h->aux, hash);
+		h->update(h->aux, hash, buf, sz);
+		h->final(h->aux, hash, out);
+	}
+}
+
+static void workers_hash(struct workers *w, void *hash) {
+	size_t i, end;
+
+	while ((i = __atomic_fetch_add(&w->next, w->chunk, __ATOMIC_RELAXED)) <
+	       w->nblocks) {
+		end = i + w->chunk < w->nblocks ? i + w->chunk : w->nblocks;
+		batch(w->hasher, hash, w->buf + i * w->size, w->size, end - i,
+		      w->digests + i * w->hasher->size);
+	}
+}
+
+static void *workers_main(void *arg) {
+	struct worker *wk = arg;
+	struct workers *w = wk->w;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->round == seen)
+			pthread_cond_wait(&w->start, &w->lock);
+		seen = w->round;
+		if (w->quit)
+			break;
+		pthread_mutex_unlock(&w->lock);
+		workers_hash(w, wk->hash);
+		pthread_mutex_lock(&w->lock);
+		if (!--w->busy)
+			pthread_cond_signal(&w->done);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+static struct workers *workers_new(size_t sz, struct hasher *hasher,
+                                   int nthreads) {
+	struct workers *w = malloc(sizeof *w);
+	int i;
+
+	w->hasher = hasher;
+	w->size = sz;
+	w->nthreads = nthreads;
+	w->threads = calloc(nthreads, sizeof(*w->threads));
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->start, NULL);
+	pthread_cond_init(&w->done, NULL);
+	w->round = 0;
+	w->busy = 0;
+	w->quit = 0;
+	for (i = 0; i < nthreads; i++) {
+		w->threads[i].w = w;
+		w->threads[i].hash = hasher->new(hasher->aux);
+		if (i && pthread_create(&w->threads[i].thread, NULL,
+		                        workers_main, &w->threads[i]))
+			abort();
+	}
+	return w;
+}
+
+static void workers_free(struct workers *w) {
+	int i;
+
+	pthread_mutex_lock(&w->lock);
+	w->quit = 1;
+	w->round++;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < w->nthreads; i++) {
+		if (i)
+			pthread_join(w->threads[i].thread, NULL);
+		w->hasher->free(w->hasher->aux, w->threads[i].hash);
+	}
+	free(w->threads);
+	free(w);
+}
+
+static void workers_run(struct workers *w, const unsigned char *buf,
+                        size_t nblocks) {
+	pthread_mutex_lock(&w->lock);
+	w->buf = buf;
+	w->nblocks = nblocks;
+	w->next = 0;
+	w->chunk = nblocks / (4 * w->nthreads);
+	if (!w->chunk)
+		w->chunk = 1;
+	w->busy = w->nthreads - 1;
+	w->round++;
+	pthread_cond_broadcast(&w->start);
+	pthread_mutex_unlock(&w->lock);
+
+	workers_hash(w, w->threads[0].hash);
+
+	pthread_mutex_lock(&w->lock);
+	while (w->busy)
+		pthread_cond_wait(&w->done, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+}
+
 struct merkle *merkle_new(size_t sz, struct hasher *hasher) {
 	struct merkle *m = malloc(sizeof *m);
+	int i;
+
 	assert(sz > hasher->size);
 	assert(!(sz % hasher->size));
-	m->parent = NULL;
 	m->size = sz;
-	m->filled = 0;
 	m->hasher = hasher;
-	m->hash = hasher->new(hasher->aux);
-	hasher->init(hasher->aux, m->hash);
+	m->depth = 1;
+	for (i = 0; i < MAXDEPTH; i++) {
+		m->level[i].hash = hasher->new(hasher->aux);
+		m->level[i].filled = 0;
+		hasher->init(hasher->aux, m->level[i].hash);
+	}
+	m->scratch = hasher->new(hasher->aux);
+	m->workers = NULL;
+	m->tree = NULL;
+	m->len = 0;
 	return m;
 }
 
-void merkle_update(struct merkle *m, const unsigned char *buf, size_t sz) {
+struct merkle *merkle_new_parallel(size_t sz, struct hasher *hasher,
+                                   int nthreads) {
+	struct merkle *m = merkle_new(sz, hasher);
+	if (nthreads > 1)
+		m->workers = workers_new(sz, hasher, nthreads);
+	return m;
+}
+
+/* Starts m over on a new stream, keeping its contexts and threads. */
+void merkle_reset(struct merkle *m) {
+	int i;
+
+	for (i = 0; i < m->depth; i++) {
+		m->hasher->init(m->hasher->aux, m->level[i].hash);
+		m->level[i].filled = 0;
+	}
+	m->depth = 1;
+	m->tree = NULL;
+	m->len = 0;
+}
+
+void merkle_free(struct merkle *m) {
+	int i;
+
+	for (i = 0; i < MAXDEPTH; i++)
+		m->hasher->free(m->hasher->aux, m->level[i].hash);
+	m->hasher->free(m->hasher->aux, m->scratch);
+	if (m->workers)
+		workers_free(m->workers);
+	free(m);
+}
+
+void merkle_record(struct merkle *m, struct merkle_tree *t) {
+	m->tree = t;
+}
+
+static void merkle_fill(struct merkle *m, int lvl, const unsigned char *buf,
+                        size_t sz);
+
+static void merkle_push(struct merkle *m, int lvl,
+                        const unsigned char *hashbuf) {
+	if (m->tree)
+		merkle_tree_add(m->tree, lvl, hashbuf);
+	if (lvl + 1 == m->depth) {
+		assert(m->depth < MAXDEPTH);
+		m->depth++;
+	}
+	merkle_fill(m, lvl + 1, hashbuf, m->hasher->size);
+}
+
+static void merkle_fill(struct merkle *m, int lvl, const unsigned char *buf,
+                        size_t sz) {
+	struct hasher *h = m->hasher;
+	struct level *l = &m->level[lvl];
 	unsigned char hashbuf[MAXHASH];
-	m->hasher->update(m->hasher->aux, m->hash, buf, sz);
-	m->filled += sz;
-	assert(m->filled <= m->size);
-	if (m->filled != m->size)
+
+	h->update(h->aux, l->hash, buf, sz);
+	l->filled += sz;
+	assert(l->filled <= m->size);
+	if (l->filled != m->size)
 		return;
-	m->hasher->final(m->hasher->aux, m->hash, hashbuf);
-	if (!m->parent)
-		m->parent = merkle_new(m->size, m->hasher);
-	merkle_update(m->parent, hashbuf, m->hasher->size);
-	m->hasher->init(m->hasher->aux, m->hash);
-	m->filled = 0;
+	h->final(h->aux, l->hash, hashbuf);
+	merkle_push(m, lvl, hashbuf);
+	h->init(h->aux, l->hash);
+	l->filled = 0;
+}
+
+/* Hashes a run of whole leaf blocks in one batch, on the pool if there is
+ * one, then feeds their digests up in order, exactly as merkle_fill() would
+ * have one at a time. */
+static size_t merkle_leaves(struct merkle *m, const unsigned char *buf,
+                            size_t nblocks) {
+	unsigned char *d = m->digests;
+	size_t i;
+
+	if (m->workers) {
+		if (nblocks > BATCHMAX)
+			nblocks = BATCHMAX;
+		workers_run(m->workers, buf, nblocks);
+		d = m->workers->digests;
+	} else {
+		if (nblocks > SERIALBATCH)
+			nblocks = SERIALBATCH;
+		batch(m->hasher, m->scratch, buf, m->size, nblocks, d);
+	}
+	for (i = 0; i < nblocks; i++)
+		merkle_push(m, 0, d + i * m->hasher->size);
+	return nblocks * m->size;
+}
+
+void merkle_update(struct merkle *m, const unsigned char *buf, size_t sz) {
+	size_t n;
+
+	m->len += sz;
+	while (sz) {
+		if (!m->level[0].filled && sz >= m->size) {
+			n = merkle_leaves(m, buf, sz / m->size);
+		} else {
+			n = m->size - m->level[0].filled;
+			if (n > sz)
+				n = sz;
+			merkle_fill(m, 0, buf, n);
+		}
+		buf += n;
+		sz -= n;
+	}
 }
 
 void merkle_final(struct merkle *m, unsigned char *buf) {
-	while (m->parent) {
-		m->hasher->final(m->hasher->aux, m->hash, buf);
-		m->parent->hasher->update(m->parent->hasher->aux,
-		                          m->parent->hash, buf,
-		                          m->hasher->size);
-		m = m->parent;
+	struct hasher *h = m->hasher;
+	int i;
+
+	for (i = 0; i < m->depth - 1; i++) {
+		h->final(h->aux, m->level[i].hash, buf);
+		h->update(h->aux, m->level[i + 1].hash, buf, h->size);
+		if (m->tree)
+			merkle_tree_add(m->tree, i, buf);
+	}
+	h->final(h->aux, m->level[i].hash, buf);
+	if (m->tree) {
+		merkle_tree_add(m->tree, i, buf);
+		m->tree->len = m->len;
 	}
-	m->hasher->final(m->hasher->aux, m->hash, buf);
+}
+
+/* Input that can't be mapped is read by a second thread into two big,
+ * page-aligned buffers, so reading one overlaps hashing the other. Each buffer
+ * is filled all the way (however short the reads) before it's handed over,
+ * which keeps the leaves in whole batches. */
+struct reader {
+	int fd;
+	size_t size;
+	unsigned char *buf[2];
+	ssize_t len[2];		/* -1 while empty, 0 at end of input */
+	int err;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *reader_main(void *arg) {
+	struct reader *r = arg;
+	ssize_t n, len;
+	int i = 0;
+
+	do {
+		pthread_mutex_lock(&r->lock);
+		while (r->len[i] != -1)
+			pthread_cond_wait(&r->cond, &r->lock);
+		pthread_mutex_unlock(&r->lock);
+		for (len = 0; (size_t)len < r->size; len += n) {
+			n = read(r->fd, r->buf[i] + len, r->size - len);
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n <= 0)
+				break;
+		}
+		pthread_mutex_lock(&r->lock);
+		if (n < 0)
+			r->err = errno;
+		r->len[i] = n < 0 ? 0 : len;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+		i = !i;
+	} while (len && n > 0);
+	return NULL;
+}
+
+static int merkle_read(struct merkle *m, int fd) {
+	struct reader r;
+	pthread_t thread;
+	ssize_t len;
+	int i = 0;
+
+	r.fd = fd;
+	r.size = READSIZE - READSIZE % m->size;
+	if (r.size < m->size)
+		r.size = m->size;
+	r.err = 0;
+	for (i = 0; i < 2; i++) {
+		if (posix_memalign((void **)&r.buf[i], PAGESIZE, r.size))
+			abort();
+		r.len[i] = -1;
+	}
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	if (pthread_create(&thread, NULL, reader_main, &r))
+		abort();
+
+	i = 0;
+	do {
+		pthread_mutex_lock(&r.lock);
+		while ((len = r.len[i]) == -1)
+			pthread_cond_wait(&r.cond, &r.lock);
+		pthread_mutex_unlock(&r.lock);
+		merkle_update(m, r.buf[i], len);
+		pthread_mutex_lock(&r.lock);
+		r.len[i] = -1;
+		pthread_cond_signal(&r.cond);
+		pthread_mutex_unlock(&r.lock);
+		i = !i;
+	} while (len == (ssize_t)r.size);
+
+	pthread_join(thread, NULL);
+	pthread_mutex_destroy(&r.lock);
+	pthread_cond_destroy(&r.cond);
+	free(r.buf[0]);
+	free(r.buf[1]);
+	errno = r.err;
+	return r.err ? -1 : 0;
+}
+
+/* Feeds everything readable from fd, from its current offset on, into m, and
+ * leaves the offset at the end. Regular files are mapped and go in as one
+ * piece; anything else goes through a reader thread. */
+int merkle_fd(struct merkle *m, int fd) {
+	long page = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	off_t pos;
+	size_t skip, len;
+	unsigned char *p;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (!S_ISREG(st.st_mode) || (pos = lseek(fd, 0, SEEK_CUR)) == -1 ||
+	    pos >= st.st_size)
+		return merkle_read(m, fd);
+	skip = pos % page;
+	len = st.st_size - pos + skip;
+	p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, pos - skip);
+	if (p == MAP_FAILED)
+		return merkle_read(m, fd);
+	madvise(p, len, MADV_SEQUENTIAL);
+	merkle_update(m, p + skip, len - skip);
+	munmap(p, len);
+	return lseek(fd, st.st_size, SEEK_SET) == -1 ? -1 : 0;
 }
 
 /* demo code starts here */
 
+/* Setting up an EVP digest from scratch means looking the algorithm up again
+ * every time, so each hasher keeps one initialized context around and new
+ * ones start as copies of it. */
+struct evpmd {
+	const EVP_MD *(*md)(void);
+	EVP_MD_CTX *tmpl;
+};
+
 void *evpmd_new(void *aux) {
+	struct evpmd *e = aux;
+	EVP_MD_CTX *tmpl;
+
+	if (!__atomic_load_n(&e->tmpl, __ATOMIC_ACQUIRE)) {
+		tmpl = EVP_MD_CTX_create();
+		EVP_DigestInit_ex(tmpl, e->md(), NULL);
+		if (!__atomic_compare_exchange_n(&e->tmpl, &(EVP_MD_CTX *){NULL},
+		                                 tmpl, 0, __ATOMIC_ACQ_REL,
+		                                 __ATOMIC_ACQUIRE))
+			EVP_MD_CTX_destroy(tmpl);
+	}
 	return EVP_MD_CTX_create();
 }
 
 void evpmd_free(void *aux, void *hash) {
+	(void)aux;
 	EVP_MD_CTX_destroy(hash);
 }
 
 void evpmd_init(void *aux, void *hash) {
-	EVP_MD *(*func)(void) = aux;
-	EVP_DigestInit(hash, func());
+	struct evpmd *e = aux;
+	EVP_MD_CTX_copy_ex(hash, e->tmpl);
 }
 
 void evpmd_update(void *aux, void *hash, const unsigned char *buf, size_t sz) {
+	(void)aux;
 	EVP_DigestUpdate(hash, buf, sz);
 }
 
 void evpmd_final(void *aux, void *hash, unsigned char *buf) {
 	unsigned int ignored = MAXHASH;
+	(void)aux;
 	EVP_DigestFinal_ex(hash, buf, &ignored);
 }
 
+void evpmd_batch(void *aux, void *hash, const unsigned char *buf, size_t sz,
+                 size_t n, unsigned char *out) {
+	struct evpmd *e = aux;
+	unsigned int len = MAXHASH;
+
+	for (; n; n--, buf += sz, out += len) {
+		EVP_MD_CTX_copy_ex(hash, e->tmpl);
+		EVP_DigestUpdate(hash, buf, sz);
+		EVP_DigestFinal_ex(hash, out, &len);
+	}
+}
+
 struct hasher md5_hasher = {
 	.new = evpmd_new,
 	.free = evpmd_free,
 	.init = evpmd_init,
 	.update = evpmd_update,
 	.final = evpmd_final,
+	.batch = evpmd_batch,
 	.size = 16,
-	.aux = EVP_md5
+	.aux = &(struct evpmd){ EVP_md5, NULL },
+	.name = "md5"
 };
 
 struct hasher sha1_hasher = {
@@ -100,8 +544,10 @@ struct hasher sha1_hasher = {
 	.init = evpmd_init,
 	.update = evpmd_update,
 	.final = evpmd_final,
+	.batch = evpmd_batch,
 	.size = 20,
-	.aux = EVP_sha1
+	.aux = &(struct evpmd){ EVP_sha1, NULL },
+	.name = "sha1"
 };
 
 struct hasher sha256_hasher = {
@@ -110,8 +556,10 @@ struct hasher sha256_hasher = {
 	.init = evpmd_init,
 	.update = evpmd_update,
 	.final = evpmd_final,
+	.batch = evpmd_batch,
 	.size = 32,
-	.aux = EVP_sha256
+	.aux = &(struct evpmd){ EVP_sha256, NULL },
+	.name = "sha256"
 };
 
 struct hasher sha512_hasher = {
@@ -120,48 +568,323 @@ struct hasher sha512_hasher = {
 	.init = evpmd_init,
 	.update = evpmd_update,
 	.final = evpmd_final,
+	.batch = evpmd_batch,
 	.size = 64,
-	.aux = EVP_sha512
+	.aux = &(struct evpmd){ EVP_sha512, NULL },
+	.name = "sha512"
 };
 
-struct {
-	const char *name;
-	struct hasher *hasher;
-} hashers[] = {
-	{ "md5", &md5_hasher },
-	{ "sha1", &sha1_hasher },
-	{ "sha256", &sha256_hasher },
-	{ "sha512", &sha512_hasher },
-	{ NULL, NULL }
+static struct hasher *hashers[] = {
+	&md5_hasher,
+	&sha1_hasher,
+	&sha256_hasher,
+	&sha512_hasher,
+	&sha256mb_hasher,
+	&blake3_hasher,
+	NULL
 };
 
+struct hasher *merkle_hasher(const char *name) {
+	int i;
+
+	for (i = 0; hashers[i]; i++)
+		if (!strcmp(name, hashers[i]->name))
+			return hashers[i];
+	return NULL;
+}
+
+/* The tool itself; merkle-bench links everything above without it. */
+#ifndef MERKLE_NOMAIN
+
+static void printhex(const unsigned char *buf, size_t sz) {
+	size_t i;
+
+	for (i = 0; i < sz; i++)
+		printf("%02x", buf[i]);
+	printf("\n");
+}
+
+static void printroot(const struct merkle_tree *t) {
+	printhex(t->level[t->depth - 1], t->hasher->size);
+}
+
+static int writetree(const struct merkle_tree *t, const char *path) {
+	FILE *f = fopen(path, "w");
+
+	if (!f || merkle_tree_save(t, f) || fclose(f)) {
+		perror(path);
+		return 1;
+	}
+	return 0;
+}
+
+static struct merkle_tree *readtree(const char *path) {
+	FILE *f = fopen(path, "r");
+	struct merkle_tree *t;
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	if (!(t = merkle_tree_load(f)))
+		fprintf(stderr, "%s: bad tree file\n", path);
+	fclose(f);
+	return t;
+}
+
+static int save(int argc, char *argv[]) {
+	struct hasher *hasher;
+	struct merkle_tree *t;
+	int fd, r;
+
+	if (argc < 6 || !(hasher = merkle_hasher(argv[2]))) {
+		fprintf(stderr, "usage: merkle save <hash type> <block size> "
+		                "<file> <tree file> [threads]\n");
+		return 1;
+	}
+	if ((fd = open(argv[4], O_RDONLY)) == -1 ||
+	    !(t = merkle_tree_fd(atoi(argv[3]), hasher,
+	                         argc > 6 ? atoi(argv[6]) : 1, fd))) {
+		perror(argv[4]);
+		return 1;
+	}
+	close(fd);
+	printroot(t);
+	r = writetree(t, argv[5]);
+	merkle_tree_free(t);
+	return r;
+}
+
+static int update(int argc, char *argv[]) {
+	struct merkle_tree *t;
+	uint64_t *ranges;
+	char *end;
+	int i, fd, r;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: merkle update <file> <tree file> "
+		                "[offset:length...]\n");
+		return 1;
+	}
+	ranges = calloc(2 * (argc - 4) + 1, sizeof *ranges);
+	for (i = 4; i < argc; i++) {
+		ranges[2 * (i - 4)] = strtoull(argv[i], &end, 0);
+		if (*end != ':') {
+			fprintf(stderr, "merkle: bad range %s\n", argv[i]);
+			return 1;
+		}
+		ranges[2 * (i - 4) + 1] = strtoull(end + 1, NULL, 0);
+	}
+	if (!(t = readtree(argv[3])))
+		return 1;
+	if ((fd = open(argv[2], O_RDONLY)) == -1 ||
+	    merkle_tree_update(t, fd, ranges, argc - 4, 1) == -1) {
+		perror(argv[2]);
+		return 1;
+	}
+	close(fd);
+	printroot(t);
+	r = writetree(t, argv[3]);
+	merkle_tree_free(t);
+	free(ranges);
+	return r;
+}
+
+static int proof(int argc, char *argv[]) {
+	struct merkle_tree *t;
+	struct merkle_proof *p;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: merkle proof <tree file> <block number>\n");
+		return 1;
+	}
+	if (!(t = readtree(argv[2])))
+		return 1;
+	if (!(p = merkle_proof(t, strtoull(argv[3], NULL, 0)))) {
+		fprintf(stderr, "merkle: no block %s\n", argv[3]);
+		return 1;
+	}
+	if (merkle_proof_save(p, stdout)) {
+		perror("merkle");
+		return 1;
+	}
+	merkle_proof_free(p);
+	merkle_tree_free(t);
+	return 0;
+}
+
+static int verify(int argc, char *argv[]) {
+	unsigned char root[MAXHASH], *block;
+	struct merkle_proof *p;
+	size_t i, len = 0;
+	ssize_t n;
+	FILE *f;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: merkle verify <root> <proof file>\n");
+		return 1;
+	}
+	if (!(f = fopen(argv[3], "r"))) {
+		perror(argv[3]);
+		return 1;
+	}
+	if (!(p = merkle_proof_load(f))) {
+		fprintf(stderr, "%s: bad proof file\n", argv[3]);
+		return 1;
+	}
+	fclose(f);
+	if (strlen(argv[2]) != 2 * p->hasher->size) {
+		fprintf(stderr, "merkle: root should be %zu hex digits\n",
+		        2 * p->hasher->size);
+		return 1;
+	}
+	for (i = 0; i < p->hasher->size; i++)
+		sscanf(argv[2] + 2 * i, "%2hhx", &root[i]);
+	block = malloc(p->size + 1);
+	while (len <= p->size &&
+	       (n = read(0, block + len, p->size + 1 - len)) > 0)
+		len += n;
+	i = merkle_verify(p, block, len, root);
+	printf("%s\n", i ? "ok" : "bad");
+	free(block);
+	merkle_proof_free(p);
+	return !i;
+}
+
+static void printrange(void *arg, uint64_t off, uint64_t len) {
+	(void)arg;
+	printf("%llu %llu\n", (unsigned long long)off, (unsigned long long)len);
+}
+
+static int diff(int argc, char *argv[]) {
+	struct merkle_tree *a, *b;
+	int fd, r = 0;
+
+	if (argc < 4) {
+		fprintf(stderr, "usage: merkle diff <old tree file> "
+		                "<new tree file> [new file]\n");
+		return 1;
+	}
+	if (!(a = readtree(argv[2])) || !(b = readtree(argv[3])))
+		return 1;
+	if (argc < 5) {
+		r = merkle_tree_diff(a, b, printrange, NULL) == -1;
+	} else if ((fd = open(argv[4], O_RDONLY)) == -1) {
+		r = 1;
+	} else {
+		r = merkle_patch_write(a, b, fd, stdout) == -1;
+		close(fd);
+	}
+	if (r)
+		perror("merkle");
+	merkle_tree_free(a);
+	merkle_tree_free(b);
+	return r;
+}
+
+static int apply(int argc, char *argv[]) {
+	struct merkle_tree *t = NULL;
+	int fd, r = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: merkle apply <file> [tree file]\n");
+		return 1;
+	}
+	if (argc > 3 && !(t = readtree(argv[3])))
+		return 1;
+	if ((fd = open(argv[2], O_RDWR | O_CREAT, 0666)) == -1 ||
+	    merkle_patch_apply(stdin, fd, t) == -1) {
+		perror(argv[2]);
+		return 1;
+	}
+	close(fd);
+	if (t) {
+		printroot(t);
+		r = writetree(t, argv[3]);
+		merkle_tree_free(t);
+	}
+	return r;
+}
+
+static int dir(int argc, char *argv[]) {
+	struct merkle_entry *e;
+	struct hasher *hasher;
+	struct merkle *m;
+	unsigned char buf[MAXHASH];
+	char *line;
+	long i, n;
+	int len;
+
+	if (argc < 5 || !(hasher = merkle_hasher(argv[2]))) {
+		fprintf(stderr, "usage: merkle dir <hash type> <block size> "
+		                "<directory> [threads]\n");
+		return 1;
+	}
+	n = merkle_dir(argv[4], atoi(argv[3]), hasher,
+	               argc > 5 ? atoi(argv[5]) : sysconf(_SC_NPROCESSORS_ONLN),
+	               &e);
+	if (n == -1) {
+		perror(argv[4]);
+		return 1;
+	}
+	m = merkle_new(atoi(argv[3]), hasher);
+	line = malloc(2 * MAXHASH + 32);
+	for (i = 0; i < n; i++) {
+		for (len = 0; len < 2 * (int)hasher->size; len += 2)
+			sprintf(line + len, "%02x", e[i].root[len / 2]);
+		len += sprintf(line + len, " %llu ", (unsigned long long)e[i].size);
+		line = realloc(line, len + strlen(e[i].path) + 2);
+		len += sprintf(line + len, "%s\n", e[i].path);
+		fputs(line, stdout);
+		merkle_update(m, (unsigned char *)line, len);
+		free(e[i].path);
+	}
+	merkle_final(m, buf);
+	printhex(buf, hasher->size);
+	merkle_free(m);
+	free(line);
+	free(e);
+	return 0;
+}
+
 int main(int argc, char *argv[]) {
 	static int blocksize = 1024;
-	unsigned char *buf;
-	int i;
+	unsigned char buf[MAXHASH];
+	int nthreads = 1;
 	struct merkle *base;
 	struct hasher *hasher = &sha256_hasher;
 
-	if (argc > 1)
-		for (i = 0; hashers[i].name; i++)
-			if (!strcmp(argv[1], hashers[i].name))
-				hasher = hashers[i].hasher;
+	if (argc > 1 && !strcmp(argv[1], "save"))
+		return save(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "update"))
+		return update(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "proof"))
+		return proof(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "verify"))
+		return verify(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "diff"))
+		return diff(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "apply"))
+		return apply(argc, argv);
+	if (argc > 1 && !strcmp(argv[1], "dir"))
+		return dir(argc, argv);
+	if (argc > 1 && merkle_hasher(argv[1]))
+		hasher = merkle_hasher(argv[1]);
 
 	if (argc > 2)
 		blocksize = atoi(argv[2]);
+	if (argc > 3)
+		nthreads = atoi(argv[3]);
 
-	buf = malloc(blocksize);
-	base = merkle_new(blocksize, hasher);
-
-	while ((i = read(0, buf, blocksize)) > 0) {
-		/* assume a short read means end of input... if we get multiple
-		 * short reads, the state machine in merkle_update() may get
-		 * broken */
-		merkle_update(base, buf, i);
+	base = merkle_new_parallel(blocksize, hasher, nthreads);
+	if (merkle_fd(base, 0) == -1) {
+		perror("merkle");
+		return 1;
 	}
 	merkle_final(base, buf);
-	for (i = 0; i < sha256_hasher.size; i++)
-		printf("%02x", buf[i]);
-	printf("\n");
+	printhex(buf, hasher->size);
+	merkle_free(base);
 	return 0;
 }
+
+#endif /* !MERKLE_NOMAIN */
@@ -3,8 +3,13 @@
 #ifndef MERKLE_H
 #define MERKLE_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
 enum {
-	MAXHASH = 64
+	MAXHASH = 64,
+	MAXDEPTH = 64	/* levels; blocks hold at least two digests */
 };
 
 struct hasher {
@@ -14,19 +19,94 @@ struct hasher {
 	void (*init)(void *aux, void *hash);
 	void (*update)(void *aux, void *hash, const unsigned char *buf, size_t sz);
 	void (*final)(void *aux, void *hash, unsigned char *hashbuf);
+	/* optional: hashes n blocks of sz bytes, laid end to end in buf, into n
+	 * digests in out. hash is a context from new() to use as scratch. */
+	void (*batch)(void *aux, void *hash, const unsigned char *buf, size_t sz,
+	              size_t n, unsigned char *out);
 	size_t size;
 	void *aux;
+	const char *name;	/* as recorded in tree files */
 };
 
 struct merkle;
 
+/* A whole tree, every level's digests, as kept in a sidecar file next to the
+ * data. level[0] holds the leaves; level[depth - 1] holds just the root. */
+struct merkle_tree {
+	struct hasher *hasher;
+	size_t size;		/* block size */
+	uint64_t len;		/* bytes hashed */
+	struct timespec mtime;	/* of the file, when it was hashed */
+	int depth;
+	size_t count[MAXDEPTH];
+	size_t cap[MAXDEPTH];
+	unsigned char *level[MAXDEPTH];
+};
+
 struct merkle *merkle_new(size_t sz, struct hasher *hasher);
+struct merkle *merkle_new_parallel(size_t sz, struct hasher *hasher,
+                                   int nthreads);
 void merkle_update(struct merkle *m, const unsigned char *buf, size_t sz);
+int merkle_fd(struct merkle *m, int fd);
 void merkle_final(struct merkle *m, unsigned char *buf);
+void merkle_reset(struct merkle *m);
+void merkle_free(struct merkle *m);
+/* Has m append every node it finishes to t, which must be fresh. */
+void merkle_record(struct merkle *m, struct merkle_tree *t);
+
+struct merkle_tree *merkle_tree_new(size_t sz, struct hasher *hasher);
+struct merkle_tree *merkle_tree_fd(size_t sz, struct hasher *hasher,
+                                   int nthreads, int fd);
+void merkle_tree_add(struct merkle_tree *t, int lvl,
+                     const unsigned char *hashbuf);
+long merkle_tree_update(struct merkle_tree *t, int fd, const uint64_t *ranges,
+                        size_t nranges, int nthreads);
+int merkle_tree_save(const struct merkle_tree *t, FILE *f);
+struct merkle_tree *merkle_tree_load(FILE *f);
+void merkle_tree_free(struct merkle_tree *t);
+
+/* The audit path for one leaf: the digests hashed with its ancestors on each
+ * level, leaves first, with the ancestors themselves left out. The shape of
+ * the tree follows from len and size. */
+struct merkle_proof {
+	struct hasher *hasher;
+	size_t size;
+	uint64_t len;
+	size_t leaf;
+	size_t pathlen;		/* digests in path */
+	unsigned char *path;
+};
+
+struct merkle_proof *merkle_proof(const struct merkle_tree *t, size_t leaf);
+int merkle_verify(const struct merkle_proof *p, const unsigned char *block,
+                  size_t sz, const unsigned char *root);
+int merkle_proof_save(const struct merkle_proof *p, FILE *f);
+struct merkle_proof *merkle_proof_load(FILE *f);
+void merkle_proof_free(struct merkle_proof *p);
+
+long merkle_tree_diff(const struct merkle_tree *a, const struct merkle_tree *b,
+                      void (*fn)(void *arg, uint64_t off, uint64_t len),
+                      void *arg);
+int merkle_patch_write(const struct merkle_tree *a, const struct merkle_tree *b,
+                       int fd, FILE *out);
+long merkle_patch_apply(FILE *in, int fd, struct merkle_tree *t);
+
+struct merkle_entry {
+	char *path;
+	uint64_t size;
+	unsigned char root[MAXHASH];
+};
+
+long merkle_dir(const char *dir, size_t sz, struct hasher *hasher,
+                int nthreads, struct merkle_entry **entries);
+
+struct hasher *merkle_hasher(const char *name);
 
 extern struct hasher md5_hasher;
 extern struct hasher sha1_hasher;
 extern struct hasher sha256_hasher;
 extern struct hasher sha512_hasher;
+extern struct hasher sha256mb_hasher;
+extern struct hasher blake3_hasher;
 
 #endif /* !MERKLE_H */
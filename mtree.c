@@ -0,0 +1,591 @@
+/* mtree.c - whole merkle trees, kept next to the data they cover
+ * A tree holds every level's digests, not just the root, so when a few blocks
+ * of a big file change only those leaves and their paths to the root need
+ * hashing again. Trees are saved as:
+ *   "MRKL" version:4 name:16 hashsize:4 blocksize:4 len:8 mtime:8 nsec:4 pad:4
+ * (little endian), then every level's digests, leaves first. The number of
+ * nodes on each level follows from len and the block size.
+ *
+ * A proof that one block belongs under a root is that block's audit path: on
+ * each level, the digests its ancestor was hashed together with. It's saved
+ * with the same header, magic "MRKP" and the leaf number in place of the
+ * mtime, followed by the path from the leaves up.
+ *
+ * Two trees of the same kind are compared from the top down, only going into
+ * nodes that differ, so a diff costs about as much as the change. A patch
+ * brings the old file up to the new one:
+ *   "MRKD" version:4 len:8, then offset:8 length:8 data... per changed run
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "merkle.h"
+
+enum {
+	VERSION = 1,
+	NAMESIZE = 16,
+	HDRSIZE = 64,
+	PATCHHDR = 16,
+	COPYSIZE = 64 << 10
+};
+
+static size_t fanout(const struct merkle_tree *t) {
+	return t->size / t->hasher->size;
+}
+
+/* Nodes per level for len bytes: the same shape merkle_update() and
+ * merkle_final() build, where the last leaf is whatever follows the last
+ * whole block (even nothing) and a file shorter than one block is its own
+ * root. Returns the depth. */
+static int shape(size_t sz, size_t hsize, uint64_t len, size_t *count) {
+	size_t n = len < sz ? 1 : len / sz + 1;
+	int d = 0;
+
+	for (;;) {
+		count[d++] = n;
+		if (n == 1)
+			return d;
+		n = (n + sz / hsize - 1) / (sz / hsize);
+	}
+}
+
+static void resize(struct merkle_tree *t, int lvl, size_t n) {
+	if (n > t->cap[lvl]) {
+		t->cap[lvl] = n;
+		t->level[lvl] = realloc(t->level[lvl], n * t->hasher->size);
+		if (!t->level[lvl])
+			abort();
+	}
+	t->count[lvl] = n;
+}
+
+struct merkle_tree *merkle_tree_new(size_t sz, struct hasher *hasher) {
+	struct merkle_tree *t = calloc(1, sizeof *t);
+
+	t->hasher = hasher;
+	t->size = sz;
+	return t;
+}
+
+void merkle_tree_free(struct merkle_tree *t) {
+	int i;
+
+	for (i = 0; i < MAXDEPTH; i++)
+		free(t->level[i]);
+	free(t);
+}
+
+void merkle_tree_add(struct merkle_tree *t, int lvl,
+                     const unsigned char *hashbuf) {
+	size_t n = t->count[lvl];
+
+	if (n == t->cap[lvl])
+		resize(t, lvl, n ? 2 * n : 64);
+	t->count[lvl] = n + 1;
+	memcpy(t->level[lvl] + n * t->hasher->size, hashbuf, t->hasher->size);
+	if (lvl >= t->depth)
+		t->depth = lvl + 1;
+}
+
+/* Hashes all of fd into a new tree, as merkle_fd() would. */
+struct merkle_tree *merkle_tree_fd(size_t sz, struct hasher *hasher,
+                                   int nthreads, int fd) {
+	struct merkle_tree *t = merkle_tree_new(sz, hasher);
+	struct merkle *m = merkle_new_parallel(sz, hasher, nthreads);
+	unsigned char buf[MAXHASH];
+	struct stat st;
+
+	merkle_record(m, t);
+	if (fstat(fd, &st) == -1 || merkle_fd(m, fd) == -1) {
+		merkle_free(m);
+		merkle_tree_free(t);
+		return NULL;
+	}
+	merkle_final(m, buf);
+	merkle_free(m);
+	t->mtime = st.st_mtim;
+	return t;
+}
+
+static void node(struct merkle_tree *t, void *hash, int lvl, size_t j) {
+	struct hasher *h = t->hasher;
+	size_t n = t->count[lvl - 1] - j * fanout(t);
+
+	if (n > fanout(t))
+		n = fanout(t);
+	h->init(h->aux, hash);
+	h->update(h->aux, hash, t->level[lvl - 1] + j * t->size, n * h->size);
+	h->final(h->aux, hash, t->level[lvl] + j * h->size);
+}
+
+/* Recomputes the leaves marked in dirty (out of the whole file, mapped at p)
+ * and every node above them. */
+static void rehash(struct merkle_tree *t, const unsigned char *p,
+                   const unsigned char *dirty) {
+	struct hasher *h = t->hasher;
+	void *hash = h->new(h->aux);
+	size_t *idx = malloc(t->count[0] * sizeof *idx);
+	size_t i, j, n = 0, len;
+	int lvl;
+
+	for (i = 0; i < t->count[0]; i++) {
+		if (!dirty[i])
+			continue;
+		len = t->len - i * t->size;
+		if (len > t->size)
+			len = t->size;
+		h->init(h->aux, hash);
+		h->update(h->aux, hash, p + i * t->size, len);
+		h->final(h->aux, hash, t->level[0] + i * h->size);
+		idx[n++] = i;
+	}
+	for (lvl = 1; lvl < t->depth; lvl++) {
+		for (i = j = 0; i < n; i++)
+			if (!j || idx[i] / fanout(t) != idx[j - 1])
+				idx[j++] = idx[i] / fanout(t);
+		for (n = j, i = 0; i < n; i++)
+			node(t, hash, lvl, idx[i]);
+	}
+	free(idx);
+	h->free(h->aux, hash);
+}
+
+/* Brings t up to date with fd after the bytes in ranges (nranges pairs of
+ * offset and length) changed; bytes past the old end always count as changed.
+ * With no ranges, the file's size and mtime say whether it changed, and if so
+ * it is hashed again and the leaves compared. Returns the number of leaves
+ * that changed, or -1 on error. */
+long merkle_tree_update(struct merkle_tree *t, int fd, const uint64_t *ranges,
+                        size_t nranges, int nthreads) {
+	struct merkle_tree *fresh;
+	size_t count[MAXDEPTH], i, first, last;
+	unsigned char *dirty, *p = NULL;
+	struct stat st;
+	long changed = 0;
+	int lvl, depth;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (!nranges) {
+		if ((uint64_t)st.st_size == t->len &&
+		    st.st_mtim.tv_sec == t->mtime.tv_sec &&
+		    st.st_mtim.tv_nsec == t->mtime.tv_nsec)
+			return 0;
+		if (!(fresh = merkle_tree_fd(t->size, t->hasher, nthreads, fd)))
+			return -1;
+		for (i = 0; i < fresh->count[0]; i++)
+			changed += i >= t->count[0] ||
+			           memcmp(fresh->level[0] + i * t->hasher->size,
+			                  t->level[0] + i * t->hasher->size,
+			                  t->hasher->size);
+		for (lvl = 0; lvl < MAXDEPTH; lvl++)
+			free(t->level[lvl]);
+		*t = *fresh;
+		free(fresh);
+		return changed;
+	}
+
+	if (st.st_size && (p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+	                            0)) == MAP_FAILED)
+		return -1;
+	depth = shape(t->size, t->hasher->size, st.st_size, count);
+	dirty = calloc(count[0], 1);
+	first = ((uint64_t)st.st_size < t->len ? (uint64_t)st.st_size : t->len) /
+	        t->size;
+	if ((uint64_t)st.st_size != t->len)
+		for (i = first; i < count[0]; i++)
+			dirty[i] = 1;
+	for (i = 0; i < nranges; i++) {
+		if (!ranges[2 * i + 1] || ranges[2 * i] >= (uint64_t)st.st_size)
+			continue;
+		first = ranges[2 * i] / t->size;
+		last = (ranges[2 * i] + ranges[2 * i + 1] - 1) / t->size;
+		for (; first <= last && first < count[0]; first++)
+			dirty[first] = 1;
+	}
+	for (i = 0; i < count[0]; i++)
+		changed += dirty[i];
+
+	for (lvl = 0; lvl < depth; lvl++)
+		resize(t, lvl, count[lvl]);
+	for (; lvl < t->depth; lvl++)
+		t->count[lvl] = 0;
+	t->depth = depth;
+	t->len = st.st_size;
+	t->mtime = st.st_mtim;
+	rehash(t, p, dirty);
+
+	free(dirty);
+	if (p)
+		munmap(p, st.st_size);
+	return changed;
+}
+
+static void put(unsigned char *p, uint64_t v, int n) {
+	for (; n; n--, v >>= 8)
+		*p++ = v;
+}
+
+static uint64_t get(const unsigned char *p, int n) {
+	uint64_t v = 0;
+
+	while (n--)
+		v = v << 8 | p[n];
+	return v;
+}
+
+int merkle_tree_save(const struct merkle_tree *t, FILE *f) {
+	unsigned char hdr[HDRSIZE] = "MRKL";
+	int i;
+
+	put(hdr + 4, VERSION, 4);
+	strncpy((char *)hdr + 8, t->hasher->name, NAMESIZE);
+	put(hdr + 24, t->hasher->size, 4);
+	put(hdr + 28, t->size, 4);
+	put(hdr + 32, t->len, 8);
+	put(hdr + 40, t->mtime.tv_sec, 8);
+	put(hdr + 48, t->mtime.tv_nsec, 4);
+	if (fwrite(hdr, HDRSIZE, 1, f) != 1)
+		return -1;
+	for (i = 0; i < t->depth; i++)
+		if (fwrite(t->level[i], t->hasher->size, t->count[i], f) !=
+		    t->count[i])
+			return -1;
+	return fflush(f);
+}
+
+struct merkle_tree *merkle_tree_load(FILE *f) {
+	unsigned char hdr[HDRSIZE];
+	char name[NAMESIZE + 1] = "";
+	struct merkle_tree *t;
+	struct hasher *hasher;
+	size_t count[MAXDEPTH];
+	int i, depth;
+
+	if (fread(hdr, HDRSIZE, 1, f) != 1 || memcmp(hdr, "MRKL", 4) ||
+	    get(hdr + 4, 4) != VERSION)
+		return NULL;
+	memcpy(name, hdr + 8, NAMESIZE);
+	if (!(hasher = merkle_hasher(name)) || get(hdr + 24, 4) != hasher->size ||
+	    get(hdr + 28, 4) <= hasher->size || get(hdr + 28, 4) % hasher->size)
+		return NULL;
+	t = merkle_tree_new(get(hdr + 28, 4), hasher);
+	t->len = get(hdr + 32, 8);
+	t->mtime.tv_sec = get(hdr + 40, 8);
+	t->mtime.tv_nsec = get(hdr + 48, 4);
+	depth = shape(t->size, hasher->size, t->len, count);
+	for (i = 0; i < depth; i++) {
+		resize(t, i, count[i]);
+		if (fread(t->level[i], hasher->size, count[i], f) != count[i]) {
+			merkle_tree_free(t);
+			return NULL;
+		}
+	}
+	t->depth = depth;
+	return t;
+}
+
+/* The span [*first, *end) of nodes on lvl hashed together with node j. */
+static void group(size_t fanout, const size_t *count, int lvl, size_t j,
+                  size_t *first, size_t *end) {
+	*first = j / fanout * fanout;
+	*end = *first + fanout < count[lvl] ? *first + fanout : count[lvl];
+}
+
+static int proofshape(const struct merkle_proof *p, size_t *count,
+                      size_t *pathlen) {
+	size_t j, first, end;
+	int lvl, depth;
+
+	depth = shape(p->size, p->hasher->size, p->len, count);
+	if (p->leaf >= count[0])
+		return -1;
+	*pathlen = 0;
+	for (lvl = 0, j = p->leaf; lvl < depth - 1; lvl++) {
+		group(p->size / p->hasher->size, count, lvl, j, &first, &end);
+		*pathlen += end - first - 1;
+		j /= p->size / p->hasher->size;
+	}
+	return depth;
+}
+
+struct merkle_proof *merkle_proof(const struct merkle_tree *t, size_t leaf) {
+	struct merkle_proof *p;
+	size_t hsize = t->hasher->size, j, k, first, end, n = 0;
+	int lvl;
+
+	if (leaf >= t->count[0])
+		return NULL;
+	p = malloc(sizeof *p);
+	p->hasher = t->hasher;
+	p->size = t->size;
+	p->len = t->len;
+	p->leaf = leaf;
+	p->path = malloc(t->depth * fanout(t) * hsize);
+	for (lvl = 0, j = leaf; lvl < t->depth - 1; lvl++, j /= fanout(t)) {
+		group(fanout(t), t->count, lvl, j, &first, &end);
+		for (k = first; k < end; k++)
+			if (k != j)
+				memcpy(p->path + n++ * hsize,
+				       t->level[lvl] + k * hsize, hsize);
+	}
+	p->pathlen = n;
+	return p;
+}
+
+void merkle_proof_free(struct merkle_proof *p) {
+	free(p->path);
+	free(p);
+}
+
+/* Checks that the sz bytes in block are p's leaf under root. This costs a
+ * hash per level, whatever the size of the file. */
+int merkle_verify(const struct merkle_proof *p, const unsigned char *block,
+                  size_t sz, const unsigned char *root) {
+	struct hasher *h = p->hasher;
+	size_t count[MAXDEPTH], j, k, first, end, pathlen, n = 0;
+	unsigned char d[MAXHASH];
+	void *hash;
+	int lvl, depth;
+
+	if ((depth = proofshape(p, count, &pathlen)) == -1 ||
+	    pathlen != p->pathlen)
+		return 0;
+	if (sz != (p->len - p->leaf * p->size < p->size ?
+	           p->len - p->leaf * p->size : p->size))
+		return 0;
+	hash = h->new(h->aux);
+	h->init(h->aux, hash);
+	h->update(h->aux, hash, block, sz);
+	h->final(h->aux, hash, d);
+	for (lvl = 0, j = p->leaf; lvl < depth - 1; lvl++) {
+		group(p->size / h->size, count, lvl, j, &first, &end);
+		h->init(h->aux, hash);
+		for (k = first; k < end; k++)
+			h->update(h->aux, hash,
+			          k == j ? d : p->path + n++ * h->size, h->size);
+		h->final(h->aux, hash, d);
+		j /= p->size / h->size;
+	}
+	h->free(h->aux, hash);
+	return !memcmp(d, root, h->size);
+}
+
+int merkle_proof_save(const struct merkle_proof *p, FILE *f) {
+	unsigned char hdr[HDRSIZE] = "MRKP";
+
+	put(hdr + 4, VERSION, 4);
+	strncpy((char *)hdr + 8, p->hasher->name, NAMESIZE);
+	put(hdr + 24, p->hasher->size, 4);
+	put(hdr + 28, p->size, 4);
+	put(hdr + 32, p->len, 8);
+	put(hdr + 40, p->leaf, 8);
+	if (fwrite(hdr, HDRSIZE, 1, f) != 1 ||
+	    fwrite(p->path, p->hasher->size, p->pathlen, f) != p->pathlen)
+		return -1;
+	return fflush(f);
+}
+
+struct merkle_proof *merkle_proof_load(FILE *f) {
+	unsigned char hdr[HDRSIZE];
+	char name[NAMESIZE + 1] = "";
+	struct merkle_proof *p;
+	struct hasher *hasher;
+	size_t count[MAXDEPTH];
+
+	if (fread(hdr, HDRSIZE, 1, f) != 1 || memcmp(hdr, "MRKP", 4) ||
+	    get(hdr + 4, 4) != VERSION)
+		return NULL;
+	memcpy(name, hdr + 8, NAMESIZE);
+	if (!(hasher = merkle_hasher(name)) || get(hdr + 24, 4) != hasher->size ||
+	    get(hdr + 28, 4) <= hasher->size || get(hdr + 28, 4) % hasher->size)
+		return NULL;
+	p = malloc(sizeof *p);
+	p->hasher = hasher;
+	p->size = get(hdr + 28, 4);
+	p->len = get(hdr + 32, 8);
+	p->leaf = get(hdr + 40, 8);
+	p->path = NULL;
+	if (proofshape(p, count, &p->pathlen) == -1 ||
+	    !(p->path = malloc(p->pathlen * hasher->size + 1)) ||
+	    fread(p->path, hasher->size, p->pathlen, f) != p->pathlen) {
+		merkle_proof_free(p);
+		return NULL;
+	}
+	return p;
+}
+
+struct nodes {
+	size_t *v;
+	size_t n;
+	size_t cap;
+};
+
+static void nodes_add(struct nodes *l, size_t j) {
+	if (l->n == l->cap) {
+		l->cap = l->cap ? 2 * l->cap : 64;
+		if (!(l->v = realloc(l->v, l->cap * sizeof *l->v)))
+			abort();
+	}
+	l->v[l->n++] = j;
+}
+
+/* Node j covers the same leaves in any tree with this fanout, so it can be
+ * compared straight across; a node b has and a doesn't is new. */
+static int differs(const struct merkle_tree *a, const struct merkle_tree *b,
+                   int lvl, size_t j) {
+	size_t hsize = b->hasher->size;
+
+	return j >= a->count[lvl] || memcmp(a->level[lvl] + j * hsize,
+	                                    b->level[lvl] + j * hsize, hsize);
+}
+
+/* Calls fn with each run of bytes in b's file whose blocks differ from a's,
+ * in order. Returns the number of leaves that differ, or -1 if the trees
+ * can't be compared. */
+long merkle_tree_diff(const struct merkle_tree *a, const struct merkle_tree *b,
+                      void (*fn)(void *arg, uint64_t off, uint64_t len),
+                      void *arg) {
+	struct nodes cur = { 0 }, next = { 0 }, tmp;
+	size_t i, j, k, end;
+	uint64_t off, stop;
+	int lvl;
+	long n;
+
+	if (a->hasher != b->hasher || a->size != b->size)
+		return -1;
+	lvl = (a->depth < b->depth ? a->depth : b->depth) - 1;
+	for (j = 0; j < b->count[lvl]; j++)
+		if (differs(a, b, lvl, j))
+			nodes_add(&cur, j);
+	for (; lvl > 0; lvl--) {
+		next.n = 0;
+		for (i = 0; i < cur.n; i++) {
+			k = cur.v[i] * fanout(b);
+			end = k + fanout(b) < b->count[lvl - 1] ?
+			      k + fanout(b) : b->count[lvl - 1];
+			for (; k < end; k++)
+				if (differs(a, b, lvl - 1, k))
+					nodes_add(&next, k);
+		}
+		tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+
+	for (i = 0; i < cur.n; i = j) {
+		for (j = i + 1; j < cur.n && cur.v[j] == cur.v[j - 1] + 1; j++)
+			;
+		off = cur.v[i] * b->size;
+		stop = (cur.v[j - 1] + 1) * b->size;
+		if (stop > b->len)
+			stop = b->len;
+		if (stop > off)
+			fn(arg, off, stop - off);
+	}
+	n = cur.n;
+	free(cur.v);
+	free(next.v);
+	return n;
+}
+
+struct patch {
+	int fd;
+	FILE *out;
+	int err;
+	unsigned char buf[COPYSIZE];
+};
+
+static void patch_range(void *arg, uint64_t off, uint64_t len) {
+	struct patch *p = arg;
+	unsigned char hdr[PATCHHDR];
+	ssize_t n;
+
+	if (p->err)
+		return;
+	put(hdr, off, 8);
+	put(hdr + 8, len, 8);
+	if (fwrite(hdr, PATCHHDR, 1, p->out) != 1) {
+		p->err = errno;
+		return;
+	}
+	for (; len; off += n, len -= n) {
+		n = pread(p->fd, p->buf, len < COPYSIZE ? len : COPYSIZE, off);
+		if (n <= 0 || fwrite(p->buf, n, 1, p->out) != 1) {
+			p->err = n ? errno : EIO;	/* file shorter than b */
+			return;
+		}
+	}
+}
+
+/* Writes the patch that turns a's file into b's to out, reading the new
+ * blocks from fd, which should hold what b was made from. */
+int merkle_patch_write(const struct merkle_tree *a, const struct merkle_tree *b,
+                       int fd, FILE *out) {
+	struct patch *p = malloc(sizeof *p);
+	unsigned char hdr[PATCHHDR] = "MRKD";
+
+	put(hdr + 4, VERSION, 4);
+	put(hdr + 8, b->len, 8);
+	p->fd = fd;
+	p->out = out;
+	p->err = 0;
+	if (fwrite(hdr, PATCHHDR, 1, out) != 1 ||
+	    merkle_tree_diff(a, b, patch_range, p) == -1)
+		p->err = p->err ? p->err : EINVAL;
+	errno = p->err;
+	free(p);
+	return errno || fflush(out) ? -1 : 0;
+}
+
+/* Applies a patch from in to the file on fd. If t is the file's tree, it is
+ * brought up to date too, rehashing just the patched blocks. Returns the
+ * number of runs patched, or -1 on error. */
+long merkle_patch_apply(FILE *in, int fd, struct merkle_tree *t) {
+	unsigned char hdr[PATCHHDR], *buf = malloc(COPYSIZE);
+	uint64_t *ranges = calloc(2, sizeof *ranges), size, off, len, n;
+	size_t nranges = 0, cap = 1;
+	long r = -1;
+
+	errno = EINVAL;
+	if (fread(hdr, PATCHHDR, 1, in) != 1 || memcmp(hdr, "MRKD", 4) ||
+	    get(hdr + 4, 4) != VERSION)
+		goto out;
+	size = get(hdr + 8, 8);
+	while (fread(hdr, PATCHHDR, 1, in) == 1) {
+		off = get(hdr, 8);
+		len = get(hdr + 8, 8);
+		if (nranges == cap) {
+			cap *= 2;
+			if (!(ranges = realloc(ranges, 2 * cap * sizeof *ranges)))
+				abort();
+		}
+		ranges[2 * nranges] = off;
+		ranges[2 * nranges++ + 1] = len;
+		for (; len; off += n, len -= n) {
+			n = len < COPYSIZE ? len : COPYSIZE;
+			if (fread(buf, n, 1, in) != 1) {
+				errno = EINVAL;
+				goto out;
+			}
+			if (pwrite(fd, buf, n, off) != (ssize_t)n)
+				goto out;
+		}
+	}
+	if (ferror(in) || ftruncate(fd, size) == -1)
+		goto out;
+	/* with nothing patched, an empty range still keeps the update from
+	 * rehashing the whole file to find out */
+	if (t && merkle_tree_update(t, fd, ranges, nranges ? nranges : 1, 1) == -1)
+		goto out;
+	r = nranges;
+out:
+	free(buf);
+	free(ranges);
+	return r;
+}
@@ -0,0 +1,473 @@
+/* qalloc-bench.c - replays allocation traces against qalloc and glibc
+ * Run as: qalloc-bench [-a alloc,...] [-m megabytes] [-n samples]
+ *                      [-s samplefile] trace...
+ * Each trace (see qtrace.h) is turned into a list of calls on numbered blocks
+ * and replayed once per allocator, in a child process of its own, so the
+ * peak RSS is that replay's (the trace included; the blocks themselves are
+ * never written to). qalloc runs on a heap of -m megabytes, mapped
+ * but untouched up front. -n times during a replay (100 by default) it stops
+ * the clock and takes a sample: the bytes the trace holds (live), the bytes
+ * the allocator has spread them over (footprint: the span up to the last
+ * block in use for qalloc; for glibc, the arena below its top chunk plus
+ * mmapped chunks, less what the bench itself had allocated when the replay
+ * began) and the fragmentation, 1 - live / footprint. One more sample is
+ * always taken at the point where the trace holds the most, so peak_live and
+ * peak_footprint (the largest sampled) describe the same moment. The bench's
+ * own arrays are mmapped, not malloced, to keep them out of glibc's numbers.
+ * The samples go to samplefile, one CSV row each; the summary is CSV on
+ * stdout, one row per replay. Frees of blocks the trace never saw made
+ * (before qtrace.so was loaded) are dropped.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qalloc.h"
+#include "qtrace.h"
+
+#define NONE 0xffffffffu
+
+/* a trace call, with its pointers turned into block numbers */
+struct op {
+	uint32_t op;
+	uint32_t align;
+	uint64_t size;
+	uint32_t id;		/* the block made */
+	uint32_t old;		/* the block freed or resized */
+};
+
+struct trace {
+	struct op *ops;
+	size_t nops;
+	size_t cap;		/* of ops */
+	size_t peak;		/* the op after which the most is live */
+	uint32_t nids;
+};
+
+struct allocator {
+	const char *name;
+	void (*init)(size_t heapsz);
+	void *(*malloc)(size_t size);
+	void *(*calloc)(size_t n, size_t size);
+	void *(*realloc)(void *ptr, size_t size);
+	void *(*memalign)(size_t align, size_t size);
+	void (*free)(void *ptr);
+	size_t (*footprint)(void);
+};
+
+struct result {
+	uint64_t ops;
+	uint64_t failed;	/* calls that came back NULL */
+	double secs;
+	uint64_t peaklive;
+	uint64_t peakfoot;
+	double frag;		/* the mean of the samples' */
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Zeroed memory that glibc doesn't know about. */
+static void *grab(size_t len) {
+	void *p = mmap(NULL, len ? len : 1, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return p;
+}
+
+static void drop(void *p, size_t len) {
+	munmap(p, len ? len : 1);
+}
+
+static void q_init(size_t heapsz) {
+	void *mem;
+
+	if (heapsz > ~0u)
+		heapsz = ~0u;
+	mem = mmap(NULL, heapsz, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	qinit(mem, heapsz);
+}
+
+static void *q_malloc(size_t size) {
+	return size > ~0u ? NULL : qalloc(size);
+}
+
+static void *q_calloc(size_t n, size_t size) {
+	return n > ~0u || size > ~0u ? NULL : qcalloc(n, size);
+}
+
+static void *q_realloc(void *ptr, size_t size) {
+	return size > ~0u ? NULL : qrealloc(ptr, size);
+}
+
+static void *q_memalign(size_t align, size_t size) {
+	return size > ~0u || align > ~0u ? NULL : qalloc_aligned(align, size);
+}
+
+struct span {
+	char *first;
+	char *top;
+};
+
+static void q_span(void *ptr, unsigned size, int used, void *arg) {
+	struct span *s = arg;
+
+	if (!s->first)
+		s->first = ptr;
+	if (used)
+		s->top = (char*)ptr + size;
+}
+
+static size_t q_footprint(void) {
+	struct qstats st;
+	struct span s = { NULL, NULL };
+
+	qstats(&st);
+	if (!st.inuse)
+		return 0;
+	/* the heap is walked in order, so the last used block ends it */
+	qwalk(q_span, &s);
+	return s.top - s.first;
+}
+
+static size_t gbase;		/* what the bench had allocated from glibc */
+
+static void g_init(size_t heapsz) {
+	struct mallinfo2 mi = mallinfo2();
+
+	(void)heapsz;
+	gbase = mi.uordblks + mi.hblkhd;
+}
+
+/* The top chunk is left out, as qalloc's untouched end is. */
+static size_t g_footprint(void) {
+	struct mallinfo2 mi = mallinfo2();
+	size_t foot = mi.arena - mi.keepcost + mi.hblkhd;
+
+	return foot > gbase ? foot - gbase : 0;
+}
+
+static struct allocator allocators[] = {
+	{ "qalloc", q_init, q_malloc, q_calloc, q_realloc, q_memalign, qfree,
+	  q_footprint },
+	{ "glibc", g_init, malloc, calloc, realloc, memalign, free,
+	  g_footprint },
+};
+
+/* Pointer to block number, for the blocks live at one point of the trace:
+ * linear probing, with deletion by shifting back. */
+struct idmap {
+	uint64_t *key;
+	uint32_t *val;
+	size_t mask;
+};
+
+static size_t slot(struct idmap *m, uint64_t key) {
+	size_t i = (key * 0x9e3779b97f4a7c15ull >> 20) & m->mask;
+
+	while (m->key[i] && m->key[i] != key)
+		i = (i + 1) & m->mask;
+	return i;
+}
+
+static uint32_t take(struct idmap *m, uint64_t key) {
+	size_t i = slot(m, key), j, k;
+	uint32_t v;
+
+	if (!m->key[i])
+		return NONE;
+	v = m->val[i];
+	m->key[i] = 0;
+	for (j = (i + 1) & m->mask; m->key[j]; j = (j + 1) & m->mask) {
+		k = (m->key[j] * 0x9e3779b97f4a7c15ull >> 20) & m->mask;
+		if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+			m->key[i] = m->key[j];
+			m->val[i] = m->val[j];
+			m->key[j] = 0;
+			i = j;
+		}
+	}
+	return v;
+}
+
+static void put(struct idmap *m, uint64_t key, uint32_t val) {
+	size_t i = slot(m, key);
+
+	m->key[i] = key;
+	m->val[i] = val;
+}
+
+static int load(const char *path, struct trace *t) {
+	struct qtrace_hdr h;
+	struct qtrace_rec r;
+	struct idmap m;
+	struct op *o;
+	struct stat st;
+	uint64_t *size, live = 0, peak = 0;
+	size_t cap, mapsz;
+	FILE *f;
+
+	if (!(f = fopen(path, "r")) || fstat(fileno(f), &st) == -1 ||
+	    fread(&h, sizeof h, 1, f) != 1 ||
+	    memcmp(h.magic, QTRACE_MAGIC, 4) || h.version != QTRACE_VERSION) {
+		fprintf(stderr, "%s: not a trace\n", path);
+		if (f)
+			fclose(f);
+		return -1;
+	}
+	cap = st.st_size / sizeof r + 1;
+	for (mapsz = 1; mapsz < 2 * cap; mapsz <<= 1)
+		;
+	m.key = grab(mapsz * sizeof *m.key);
+	m.val = grab(mapsz * sizeof *m.val);
+	m.mask = mapsz - 1;
+	t->ops = grab(cap * sizeof *t->ops);
+	t->cap = cap;
+	t->nops = 0;
+	t->nids = 0;
+	t->peak = 0;
+	size = grab(cap * sizeof *size);
+	while (fread(&r, sizeof r, 1, f) == 1) {
+		o = &t->ops[t->nops];
+		o->op = r.op;
+		o->align = r.align;
+		o->size = r.size;
+		o->id = o->old = NONE;
+		/* a failed realloc changed nothing */
+		if (r.op == QT_REALLOC && !r.ptr && r.size)
+			continue;
+		if (r.op == QT_FREE || r.op == QT_REALLOC) {
+			o->old = r.old ? take(&m, r.old) : NONE;
+			if (o->old == NONE && (r.op == QT_FREE || !r.ptr))
+				continue;
+			/* realloc(ptr, 0) frees, and realloc of a block we
+			 * never saw is as good as a malloc */
+			if (r.op == QT_REALLOC && !r.ptr)
+				o->op = QT_FREE;
+			else if (r.op == QT_REALLOC && o->old == NONE)
+				o->op = QT_MALLOC;
+		} else if (!r.ptr) {
+			continue;
+		}
+		if (o->old != NONE)
+			live -= size[o->old];
+		if (r.ptr) {
+			o->id = t->nids++;
+			put(&m, r.ptr, o->id);
+			live += size[o->id] = r.size;
+		}
+		if (live > peak) {
+			peak = live;
+			t->peak = t->nops;
+		}
+		t->nops++;
+	}
+	drop(m.key, mapsz * sizeof *m.key);
+	drop(m.val, mapsz * sizeof *m.val);
+	drop(size, cap * sizeof *size);
+	fclose(f);
+	return 0;
+}
+
+static void sample(struct allocator *a, struct result *res, uint64_t live,
+                   size_t i, const char *name, FILE *out) {
+	size_t foot = a->footprint();
+	double frag = foot > live ? 1 - (double)live / foot : 0;
+
+	if (foot > res->peakfoot)
+		res->peakfoot = foot;
+	res->frag += frag;
+	if (out)
+		fprintf(out, "%s,%s,%zu,%lu,%zu,%.4f\n", name, a->name, i,
+		        (unsigned long)live, foot, frag);
+}
+
+static void replay(struct allocator *a, struct trace *t, size_t heapsz,
+                   int nsamples, const char *name, FILE *out,
+                   struct result *res) {
+	void **blk = grab((t->nids + 1) * sizeof *blk);
+	uint64_t *size = grab((t->nids + 1) * sizeof *size);
+	uint64_t live = 0, sz, t0, paused = 0;
+	size_t i, every = t->nops / nsamples + 1;
+	struct op *o;
+	void *ptr;
+	int n = 0;
+
+	memset(res, 0, sizeof *res);
+	a->init(heapsz);
+	t0 = now_ns();
+	for (i = 0; i < t->nops; i++) {
+		o = &t->ops[i];
+		ptr = NULL;
+		sz = o->size;
+		switch (o->op) {
+			case QT_MALLOC:
+				ptr = a->malloc(o->size);
+				break;
+			case QT_CALLOC:
+				ptr = a->calloc(1, o->size);
+				break;
+			case QT_MEMALIGN:
+				ptr = a->memalign(o->align, o->size);
+				break;
+			case QT_REALLOC:
+				/* if it fails, the old block goes on under the
+				 * new number */
+				if (!(ptr = a->realloc(blk[o->old], o->size))) {
+					res->failed++;
+					ptr = blk[o->old];
+					sz = size[o->old];
+				}
+				/* fallthrough */
+			case QT_FREE:
+				if (o->op == QT_FREE)
+					a->free(blk[o->old]);
+				live -= size[o->old];
+				blk[o->old] = NULL;
+				size[o->old] = 0;
+				break;
+		}
+		if (o->id != NONE) {
+			if (!ptr && o->op != QT_REALLOC)
+				res->failed++;
+			blk[o->id] = ptr;
+			live += size[o->id] = ptr ? sz : 0;
+		}
+		if (live > res->peaklive)
+			res->peaklive = live;
+		if (i % every == every - 1 || i == t->peak) {
+			uint64_t p0 = now_ns();
+
+			sample(a, res, live, i + 1, name, out);
+			n++;
+			paused += now_ns() - p0;
+		}
+	}
+	res->secs = (now_ns() - t0 - paused) / 1e9;
+	res->ops = t->nops;
+	if (n)
+		res->frag /= n;
+	drop(blk, (t->nids + 1) * sizeof *blk);
+	drop(size, (t->nids + 1) * sizeof *size);
+}
+
+static void run(struct allocator *a, struct trace *t, size_t heapsz,
+                int nsamples, const char *name, FILE *out) {
+	struct result res;
+	struct rusage ru;
+	int pipefd[2];
+	pid_t pid;
+
+	fflush(stdout);
+	if (out)
+		fflush(out);
+	if (pipe(pipefd) == -1 || (pid = fork()) == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (!pid) {
+		close(pipefd[0]);
+		replay(a, t, heapsz, nsamples, name, out, &res);
+		if (out)
+			fflush(out);
+		_exit(write(pipefd[1], &res, sizeof res) != sizeof res);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &res, sizeof res) != sizeof res)
+		memset(&res, 0, sizeof res);
+	close(pipefd[0]);
+	if (wait4(pid, NULL, 0, &ru) == -1)
+		memset(&ru, 0, sizeof ru);
+	printf("%s,%s,%lu,%lu,%.4f,%.0f,%lu,%lu,%ld,%.4f\n", name, a->name,
+	       (unsigned long)res.ops, (unsigned long)res.failed, res.secs,
+	       res.secs ? res.ops / res.secs : 0, (unsigned long)res.peaklive,
+	       (unsigned long)res.peakfoot, ru.ru_maxrss, res.frag);
+}
+
+static void usage(const char *progn) {
+	printf("Usage: %s [-a alloc,...] [-m megabytes] [-n samples]\n"
+	       "       [-s samplefile] trace...\n", progn);
+}
+
+int main(int argc, char *argv[]) {
+	const char *which = "qalloc,glibc";
+	size_t heapsz = (size_t)1024 << 20;
+	int nsamples = 100;
+	FILE *out = NULL;
+	struct trace t;
+	char *list, *s;
+	int opt, i;
+	size_t j;
+
+	while ((opt = getopt(argc, argv, "a:m:n:s:")) != -1) {
+		switch (opt) {
+			case 'a':
+				which = optarg;
+				break;
+			case 'm':
+				heapsz = (size_t)atoi(optarg) << 20;
+				break;
+			case 'n':
+				nsamples = atoi(optarg);
+				break;
+			case 's':
+				if (!(out = fopen(optarg, "w"))) {
+					perror(optarg);
+					exit(1);
+				}
+				fprintf(out, "trace,alloc,op,live,footprint,"
+				        "frag\n");
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if (optind == argc || nsamples < 1 || !heapsz) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	printf("trace,alloc,ops,failed,secs,ops_per_s,peak_live,"
+	       "peak_footprint,peak_rss_kb,frag\n");
+	for (i = optind; i < argc; i++) {
+		if (load(argv[i], &t) == -1)
+			continue;
+		list = strdup(which);
+		for (s = strtok(list, ","); s; s = strtok(NULL, ","))
+			for (j = 0; j < sizeof allocators / sizeof *allocators;
+			     j++)
+				if (!strcmp(s, allocators[j].name))
+					run(&allocators[j], &t, heapsz,
+					    nsamples, argv[i], out);
+		free(list);
+		drop(t.ops, t.cap * sizeof *t.ops);
+	}
+	if (out)
+		fclose(out);
+	return 0;
+}
@@ -2,9 +2,16 @@
 
 #include "qalloc.h"
 
+#ifdef QALLOC_THREADS
+#include <pthread.h>
+#endif
+
+#ifndef NULL
 #define NULL			(void*)0
+#endif
 #define FFREE			0x00000001
-#define MINBSZ		4
+#define PFREE			0x00000002	/* the block before is free */
+#define MINBSZ		16	/* header, free list links, footer */
 
 #define SZ(ptr)		*((unsigned*)ptr)
 #define BSZ(p)		(SZ(p) & ~3)
@@ -16,55 +23,778 @@
 #define FREE(p)		SZ(p) |= FFREE
 #define ALLOC(p)	SZ(p) &= ~FFREE;
 
-static struct {
+/* A free block ends in a copy of its size, so the block after it (which has
+ * PFREE set) can find its start. */
+#define FOOT(p)		((unsigned*)NX(p))[-1]
+#define PV(p)		(void*)((char*)p - ((unsigned*)p)[-1])
+
+/* Free blocks are indexed two-level segregated fit (TLSF): the first level
+ * splits sizes by powers of two, the second splits each of those into SLCOUNT
+ * even ranges, and a bitmap per level says which lists are non-empty, so
+ * finding a big enough block is a couple of bit scans. Free blocks link to
+ * each other by offset from the start of the arena, in the two words after
+ * their header. */
+#define SLBITS		4
+#define SLCOUNT		(1 << SLBITS)
+#define FLSHIFT		(SLBITS + 2)	/* sizes under 1<<FLSHIFT share fl 0 */
+#define FLCOUNT		(32 - FLSHIFT + 1)
+#define NIL		0xffffffffu
+
+#define NEXT(p)		((unsigned*)(p))[1]
+#define PREV(p)		((unsigned*)(p))[2]
+#define OFF(h, p)	(unsigned)((char*)(p) - (char*)(h)->start)
+#define AT(h, o)	(void*)((char*)(h)->start + (o))
+
+/* A heap's bookkeeping sits at the start of the memory it was given, so
+ * dropping that memory drops the heap. It can grow at the end, through grow,
+ * and give back the seg-sized, seg-aligned pieces of free blocks through
+ * release (see qheap_segments()). */
+struct qheap {
 	void *start;
 	void *end;
-} arena;
+	unsigned flmap;
+	unsigned slmap[FLCOUNT];
+	unsigned head[FLCOUNT][SLCOUNT];
+	unsigned inuse;		/* bytes in allocated blocks */
+	unsigned peak;		/* the most inuse has been */
+	unsigned nfree;		/* free blocks */
+	int tailfree;		/* the last block is free: PFREE for the end */
+	unsigned seg;
+	unsigned (*grow)(void *end, unsigned size);
+	void (*release)(void *ptr, unsigned size);
+};
 
-static void qjoin();
+static struct qheap *heap;	/* qinit()'s */
 
-void qinit(void *start, unsigned size) {
-	arena.start = start;
-	SZ(start) = size;
-	FREE(start);
-	arena.end = (char*)start + size;
+static int fls(unsigned x) {
+	return 31 - __builtin_clz(x);
 }
 
-void *qalloc(unsigned size) {
-	void *p = arena.start;
-	void *n = NULL;
+static void mapping(unsigned size, int *fl, int *sl) {
+	if (size < (1 << FLSHIFT)) {
+		*fl = 0;
+		*sl = size >> 2;
+	} else {
+		*fl = fls(size);
+		*sl = (size >> (*fl - SLBITS)) ^ SLCOUNT;
+		*fl -= FLSHIFT - 1;
+	}
+}
+
+static void qlink(struct qheap *h, void *p) {
+	int fl, sl;
+
+	mapping(BSZ(p), &fl, &sl);
+	NEXT(p) = h->head[fl][sl];
+	PREV(p) = NIL;
+	if (NEXT(p) != NIL)
+		PREV(AT(h, NEXT(p))) = OFF(h, p);
+	h->head[fl][sl] = OFF(h, p);
+	h->flmap |= 1u << fl;
+	h->slmap[fl] |= 1u << sl;
+	h->nfree++;
+}
 
+static void qunlink(struct qheap *h, void *p) {
+	int fl, sl;
+
+	h->nfree--;
+	mapping(BSZ(p), &fl, &sl);
+	if (NEXT(p) != NIL)
+		PREV(AT(h, NEXT(p))) = PREV(p);
+	if (PREV(p) != NIL)
+		NEXT(AT(h, PREV(p))) = NEXT(p);
+	else if ((h->head[fl][sl] = NEXT(p)) == NIL &&
+	         !(h->slmap[fl] &= ~(1u << sl)))
+		h->flmap &= ~(1u << fl);
+}
+
+/* A free block of at least size bytes: the first one on the smallest list
+ * whose blocks are all big enough. */
+static void *find(struct qheap *h, unsigned size) {
+	unsigned map;
+	int fl, sl;
+
+	if (size >= (1 << FLSHIFT)) {
+		if (size > ~0u - (1u << (fls(size) - SLBITS)))
+			return NULL;
+		size += (1u << (fls(size) - SLBITS)) - 1;
+	}
+	mapping(size, &fl, &sl);
+	map = h->slmap[fl] & (~0u << sl);
+	if (!map) {
+		map = h->flmap & (~0u << (fl + 1));
+		if (!map)
+			return NULL;
+		fl = __builtin_ctz(map);
+		map = h->slmap[fl];
+	}
+	return AT(h, h->head[fl][__builtin_ctz(map)]);
+}
+
+/* Sets up a heap in the size bytes at start, returning NULL if they can't
+ * hold its bookkeeping. */
+struct qheap *qheap_init(void *start, unsigned size) {
+	struct qheap *h;
+	unsigned skip;
+	int i, j;
+
+	skip = ((-(unsigned long)start) & (sizeof(void*) - 1)) + sizeof(*h);
+	if (size < skip)
+		return NULL;
+	h = (struct qheap*)((char*)start + skip - sizeof(*h));
+	h->start = (char*)start + skip;
+	h->flmap = 0;
+	h->inuse = h->peak = h->nfree = 0;
+	for (i = 0; i < FLCOUNT; i++) {
+		h->slmap[i] = 0;
+		for (j = 0; j < SLCOUNT; j++)
+			h->head[i][j] = NIL;
+	}
+	h->seg = 0;
+	h->grow = NULL;
+	h->release = NULL;
+	size = (size - skip) & ~3;
+	if (size < MINBSZ)
+		size = 0;
+	h->end = (char*)h->start + size;
+	if (!(h->tailfree = size != 0))
+		return h;
+	SZ(h->start) = size;
+	FREE(h->start);
+	FOOT(h->start) = size;
+	qlink(h, h->start);
+	return h;
+}
+
+static int extend(struct qheap *h, unsigned size);
+
+void *qheap_alloc(struct qheap *h, unsigned size) {
+	void *p;
+	void *n;
+
+	if (size > ~0u - 8)
+		return NULL;
 	size = RNDSZ(size);
+	if (size < MINBSZ)
+		size = MINBSZ;
+	if (!(p = find(h, size)) &&
+	    !(h->grow && extend(h, size) && (p = find(h, size))))
+		return NULL;
+	qunlink(h, p);
 
-	while (p && p < arena.end) {
-		if (!ISFREE(p) || BSZ(p) < size) {
-			p = NX(p);
-			continue;
-		}
+	if (BSZ(p) - size >= MINBSZ) {
+		n = (char*)p + size;
+		SZ(n) = BSZ(p) - size;
+		FREE(n);
+		FOOT(n) = BSZ(n);
+		qlink(h, n);
+		SZ(p) = size | (SZ(p) & PFREE);
+	} else if (NX(p) < h->end) {
+		SZ(NX(p)) &= ~PFREE;
+	} else {
+		h->tailfree = 0;
+	}
+
+	ALLOC(p);
+	if ((h->inuse += BSZ(p)) > h->peak)
+		h->peak = h->inuse;
+	return (char*)p + 4;
+}
+
+/* Makes block p free. Free blocks never sit next to each other, so at most
+ * the two neighbours need merging, and the tags say where they are. Returns
+ * the merged block. */
+static void *join(struct qheap *h, void *p) {
+	void *n;
+	unsigned size;
+
+	size = BSZ(p);
+	n = NX(p);
+	if (n < h->end && ISFREE(n)) {
+		qunlink(h, n);
+		size += BSZ(n);
+	}
+	if (SZ(p) & PFREE) {
+		p = PV(p);
+		qunlink(h, p);
+		size += BSZ(p);
+	}
+	SZ(p) = size | FFREE;
+	FOOT(p) = size;
+	if (NX(p) < h->end)
+		SZ(NX(p)) |= PFREE;
+	else
+		h->tailfree = 1;
+	qlink(h, p);
+	return p;
+}
+
+/* Gives back the whole segments of free block m that freeing the size bytes
+ * at p emptied: the ones p overlaps. m's header, links and footer stay. */
+static void drop(struct qheap *h, void *m, void *p, unsigned size) {
+	unsigned long seg = h->seg;
+	unsigned long lo = ((unsigned long)m + 12 + seg - 1) & -seg;
+	unsigned long hi = ((unsigned long)m + BSZ(m) - 4) & -seg;
+	unsigned long plo = (unsigned long)p & -seg;
+	unsigned long phi = ((unsigned long)p + size + seg - 1) & -seg;
+
+	if (lo < plo)
+		lo = plo;
+	if (hi > phi)
+		hi = phi;
+	if (lo < hi)
+		h->release((void*)lo, hi - lo);
+}
+
+void qheap_free(struct qheap *h, void *ptr) {
+	void *p = (char*)ptr - 4;
+	void *m;
+	unsigned size;
+
+	if (!ptr)
+		return;
+	size = BSZ(p);
+	h->inuse -= size;
+	m = join(h, p);
+	if (h->release && BSZ(m) >= h->seg)
+		drop(h, m, p, size);
+}
+
+/* Asks grow for at least size more bytes at the end, with room for find()'s
+ * rounding, and adds them as a free block. The heap can't pass 4GB, as free
+ * blocks are found by 32-bit offset. */
+static int extend(struct qheap *h, unsigned size) {
+	void *p = h->end;
+	unsigned have = (char*)h->end - (char*)h->start;
+	unsigned n;
+
+	if (size > (~0u - have) / 2)
+		return 0;
+	n = h->grow(p, size + (size >> SLBITS) + MINBSZ) & ~3;
+	if (n < MINBSZ || n >= ~0u - have)
+		return 0;
+	SZ(p) = n | (h->tailfree ? PFREE : 0);
+	h->end = (char*)p + n;
+	join(h, p);
+	return 1;
+}
 
-		if (BSZ(p) > size) {
-			n = (char*)p + size;
-			SZ(n) = SZ(p) - size;
-			SZ(p) = size;
+/* Lets h grow: grow is asked to make at least size bytes at end usable, and
+ * says how many it did (0 for none). When a free block comes to cover whole
+ * seg-aligned segments, release is told their address and size; seg is a
+ * power of two. */
+void qheap_segments(struct qheap *h, unsigned seg,
+                    unsigned (*grow)(void *end, unsigned size),
+                    void (*release)(void *ptr, unsigned size)) {
+	h->seg = seg;
+	h->grow = grow;
+	h->release = seg ? release : NULL;
+}
+
+/* Cuts allocated block p down to size bytes, if what's left over is worth
+ * having: the tail becomes a block of its own and is freed. */
+static void trim(struct qheap *h, void *p, unsigned size) {
+	void *n;
+
+	if (BSZ(p) - size < MINBSZ)
+		return;
+	n = (char*)p + size;
+	SZ(n) = BSZ(p) - size;
+	SZ(p) = size | (SZ(p) & PFREE);
+	qheap_free(h, (char*)n + 4);
+}
+
+/* Resizes the block under ptr where it stands, taking in the block after it
+ * if that's free; returns 0 if it won't fit there. */
+static int resize(struct qheap *h, void *ptr, unsigned size) {
+	void *p = (char*)ptr - 4;
+	void *n = NX(p);
+
+	if (size > ~0u - 8)
+		return 0;
+	size = RNDSZ(size);
+	if (size < MINBSZ)
+		size = MINBSZ;
+	if (size > BSZ(p)) {
+		if (n >= h->end || !ISFREE(n) || BSZ(p) + BSZ(n) < size)
+			return 0;
+		qunlink(h, n);
+		if ((h->inuse += BSZ(n)) > h->peak)
+			h->peak = h->inuse;
+		SZ(p) = (BSZ(p) + BSZ(n)) | (SZ(p) & PFREE);
+		if (NX(p) < h->end)
+			SZ(NX(p)) &= ~PFREE;
+		else
+			h->tailfree = 0;
+	}
+	trim(h, p, size);
+	return 1;
+}
+
+static void copy(void *dst, void *src, unsigned size) {
+	char *d = dst;
+	char *s = src;
+
+	while (size--)
+		*d++ = *s++;
+}
+
+static void zero(void *ptr, unsigned size) {
+	char *d = ptr;
+
+	while (size--)
+		*d++ = 0;
+}
+
+void *qheap_realloc(struct qheap *h, void *ptr, unsigned size) {
+	void *p = (char*)ptr - 4;
+	void *n;
+	unsigned old;
+
+	if (!ptr)
+		return qheap_alloc(h, size);
+	if (resize(h, ptr, size))
+		return ptr;
+	if (!(n = qheap_alloc(h, size)))
+		return NULL;
+	old = BSZ(p) - 4;
+	copy(n, ptr, old < size ? old : size);
+	qheap_free(h, ptr);
+	return n;
+}
+
+void *qheap_calloc(struct qheap *h, unsigned n, unsigned size) {
+	void *ptr;
+
+	if (size && n > ~0u / size)
+		return NULL;
+	if ((ptr = qheap_alloc(h, n * size)))
+		zero(ptr, n * size);
+	return ptr;
+}
+
+/* Takes enough to find an aligned spot at least MINBSZ in, so the bytes
+ * before it can be a free block, and then gives back both ends. align is a
+ * power of two. */
+void *qheap_alloc_aligned(struct qheap *h, unsigned align, unsigned size) {
+	char *ptr;
+	void *p, *q;
+	unsigned gap;
+
+	if (align <= 4)
+		return qheap_alloc(h, size);
+	if (size < MINBSZ)
+		size = MINBSZ;
+	if (size > ~0u - 8 - align - MINBSZ ||
+	    !(ptr = qheap_alloc(h, size + align + MINBSZ)))
+		return NULL;
+	gap = -(unsigned long)ptr & (align - 1);
+	if (gap) {
+		while (gap < MINBSZ)
+			gap += align;
+		p = ptr - 4;
+		q = ptr - 4 + gap;
+		SZ(q) = BSZ(p) - gap;
+		SZ(p) = gap | (SZ(p) & PFREE);
+		qheap_free(h, ptr);
+		ptr += gap;
+	}
+	resize(h, ptr, size);
+	return ptr;
+}
+
+void qheap_stats(struct qheap *h, struct qstats *st) {
+	unsigned o;
+	int fl;
+
+	st->size = (char*)h->end - (char*)h->start;
+	st->inuse = h->inuse;
+	st->free = st->size - h->inuse;
+	st->peak = h->peak;
+	st->nfree = h->nfree;
+	st->largest = 0;
+	if (h->flmap) {
+		fl = fls(h->flmap);
+		o = h->head[fl][fls(h->slmap[fl])];
+		for (; o != NIL; o = NEXT(AT(h, o)))
+			if (BSZ(AT(h, o)) > st->largest)
+				st->largest = BSZ(AT(h, o));
+	}
+	st->frag = st->free ? 1 - (double)st->largest / st->free : 0;
+}
+
+/* Calls fn on every block, in address order. The heap had better be sound. */
+void qheap_walk(struct qheap *h, void (*fn)(void *ptr, unsigned size,
+                                            int used, void *arg), void *arg) {
+	void *p;
+
+	for (p = h->start; p < h->end; p = NX(p))
+		fn((char*)p + 4, BSZ(p) - 4, !ISFREE(p), arg);
+}
+
+/* Walks the blocks and then the free lists, checking every tag, link and
+ * count against the rest. Returns the first block found wrong (the one whose
+ * header is bad, or that sits on a list it shouldn't), or NULL. */
+void *qheap_check(struct qheap *h) {
+	void *p;
+	unsigned o, prev, n = 0, listed = 0;
+	int fl, sl, f, l, pfree = 0;
+
+	for (p = h->start; p < h->end; p = NX(p)) {
+		if (BSZ(p) < MINBSZ ||
+		    BSZ(p) > (unsigned long)((char*)h->end - (char*)p) ||
+		    !(SZ(p) & PFREE) != !pfree)
+			return p;
+		if ((pfree = ISFREE(p))) {
+			if ((SZ(p) & PFREE) || FOOT(p) != BSZ(p))
+				return p;
+			n++;
 		}
-		
-		ALLOC(p);
-		return p;
 	}
-	return NULL;
+	if (n != h->nfree || !h->tailfree != !pfree)
+		return h->start;
+	for (fl = 0; fl < FLCOUNT; fl++)
+		for (sl = 0; sl < SLCOUNT; sl++) {
+			if ((h->head[fl][sl] == NIL) !=
+			    !(h->slmap[fl] & (1u << sl)))
+				return h->start;
+			prev = NIL;
+			for (o = h->head[fl][sl]; o != NIL; o = NEXT(p)) {
+				p = AT(h, o);
+				if (o >= (char*)h->end - (char*)h->start ||
+				    o & 3 || ++listed > n)
+					return h->start;
+				mapping(BSZ(p), &f, &l);
+				if (!ISFREE(p) || f != fl || l != sl ||
+				    PREV(p) != prev)
+					return p;
+				prev = o;
+			}
+			if (!h->slmap[fl] != !(h->flmap & (1u << fl)))
+				return h->start;
+		}
+	return listed == n ? NULL : h->start;
+}
+
+/* A region hands out memory by moving a pointer along, with no headers, and
+ * takes it back only all at once: everything since a mark, or everything.
+ * Like a heap, it keeps its bookkeeping at the start of its memory, which
+ * can come from anywhere, a heap block included, and a heap can just as well
+ * be set up in memory from a region. */
+struct qregion {
+	char *cur;
+	char *end;
+	void *mem;	/* what qregion_init() was given */
+};
+
+struct qregion *qregion_init(void *start, unsigned size) {
+	struct qregion *r;
+	unsigned skip;
+
+	skip = ((-(unsigned long)start) & (sizeof(void*) - 1)) + sizeof(*r);
+	if (size < skip)
+		return NULL;
+	r = (struct qregion*)((char*)start + skip - sizeof(*r));
+	r->cur = (char*)start + skip;
+	r->end = (char*)start + size;
+	r->mem = start;
+	return r;
+}
+
+void *qregion_alloc(struct qregion *r, unsigned size) {
+	char *ptr = r->cur;
+
+	if (size > ~0u - 3 || ALIGN(size) > (unsigned long)(r->end - r->cur))
+		return NULL;
+	r->cur += ALIGN(size);
+	return ptr;
+}
+
+/* There is nothing to do: the memory comes back with the region's. */
+void qregion_free(struct qregion *r, void *ptr) {
+	(void)r;
+	(void)ptr;
+}
+
+void *qregion_mark(struct qregion *r) {
+	return r->cur;
+}
+
+/* Frees everything allocated since mark was taken. */
+void qregion_release(struct qregion *r, void *mark) {
+	r->cur = mark;
+}
+
+void qregion_reset(struct qregion *r) {
+	r->cur = (char*)(r + 1);
+}
+
+struct qregion *qregion_new(struct qheap *h, unsigned size) {
+	struct qregion *r;
+	void *ptr;
+
+	if (!(ptr = qheap_alloc(h, size)))
+		return NULL;
+	if (!(r = qregion_init(ptr, size)))
+		qheap_free(h, ptr);
+	return r;
+}
+
+void qregion_delete(struct qheap *h, struct qregion *r) {
+	if (r)
+		qheap_free(h, r->mem);
+}
+
+/* The bytes ptr's block has room for, which can be more than were asked
+ * for. Read in one go, as a neighbour may be flipping PFREE. */
+unsigned qsize(void *ptr) {
+	return (__atomic_load_n((unsigned*)ptr - 1, __ATOMIC_RELAXED) & ~3) - 4;
+}
+
+/* Not locked: call it before the heap is shared. */
+void qsegments(unsigned seg, unsigned (*grow)(void *end, unsigned size),
+               void (*release)(void *ptr, unsigned size)) {
+	qheap_segments(heap, seg, grow, release);
+}
+
+#ifndef QALLOC_THREADS
+
+void qinit(void *start, unsigned size) {
+	heap = qheap_init(start, size);
+}
+
+void *qalloc(unsigned size) {
+	return heap ? qheap_alloc(heap, size) : NULL;
+}
+
+void qstats(struct qstats *st) {
+	qheap_stats(heap, st);
+}
+
+void qwalk(void (*fn)(void *ptr, unsigned size, int used, void *arg),
+           void *arg) {
+	qheap_walk(heap, fn, arg);
+}
+
+void *qcheck(void) {
+	return qheap_check(heap);
 }
 
 void qfree(void *ptr) {
-	FREE(ptr);
-	qjoin();
-}
-static void qjoin() {
-	void *p = arena.start;
-	while (p && p < arena.end) {
-		if (NX(p) < arena.end && ISFREE(p) && ISFREE(NX(p))) {
-			SZ(p) += BSZ(NX(p));
-		} else {
-			p = NX(p);
+	qheap_free(heap, ptr);
+}
+
+void *qrealloc(void *ptr, unsigned size) {
+	return heap ? qheap_realloc(heap, ptr, size) : NULL;
+}
+
+void *qcalloc(unsigned n, unsigned size) {
+	return heap ? qheap_calloc(heap, n, size) : NULL;
+}
+
+void *qalloc_aligned(unsigned align, unsigned size) {
+	return heap ? qheap_alloc_aligned(heap, align, size) : NULL;
+}
+
+#else
+
+/* With QALLOC_THREADS, the default heap is shared and locked, but each thread
+ * keeps the small blocks it frees on per-size lists and allocates from those
+ * without the lock. Blocks move between a thread and the heap BATCH at a time,
+ * and go back to the heap when the thread exits. Cached blocks still look
+ * allocated to the heap. The qheap_* calls are never locked. */
+#define CLASSSZ		16
+#define CLASSES		16	/* blocks of 16, 32 ... 256 bytes */
+#define BATCH		16
+#define CACHEMAX	(4 * BATCH)	/* per class */
+#define LINK(ptr)	*((void**)ptr)
+
+struct tcache {
+	void *bin[CLASSES];
+	unsigned count[CLASSES];
+	int live;		/* registered for the exit flush */
+};
+
+static __thread struct tcache tcache;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+
+static void tflush(struct tcache *t, int c, unsigned n) {
+	void *ptr;
+
+	pthread_mutex_lock(&lock);
+	for (; n && t->bin[c]; n--) {
+		ptr = t->bin[c];
+		t->bin[c] = LINK(ptr);
+		t->count[c]--;
+		qheap_free(heap, ptr);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+static void texit(void *arg) {
+	int c;
+
+	for (c = 0; c < CLASSES; c++)
+		tflush(arg, c, ~0u);
+}
+
+static void tkey(void) {
+	pthread_key_create(&key, texit);
+}
+
+void qinit(void *start, unsigned size) {
+	heap = qheap_init(start, size);
+}
+
+/* For holding the heap still over a fork(), with pthread_atfork(): a child
+ * keeps the forking thread's cache, and the other threads' are lost. */
+void qlock(void) {
+	pthread_mutex_lock(&lock);
+}
+
+void qunlock(void) {
+	pthread_mutex_unlock(&lock);
+}
+
+static struct tcache *tget(void) {
+	struct tcache *t = &tcache;
+
+	/* live first: setting the key can allocate, and come back here */
+	if (!t->live) {
+		t->live = 1;
+		pthread_once(&once, tkey);
+		pthread_setspecific(key, t);
+	}
+	return t;
+}
+
+void *qalloc(unsigned size) {
+	struct tcache *t;
+	void *ptr;
+	int c, i;
+
+	if (!heap)
+		return NULL;
+	if (size > CLASSES * CLASSSZ - 4) {
+		pthread_mutex_lock(&lock);
+		ptr = qheap_alloc(heap, size);
+		pthread_mutex_unlock(&lock);
+		return ptr;
+	}
+	t = tget();
+	c = (RNDSZ(size) - 1) / CLASSSZ;
+	if (!t->bin[c]) {
+		pthread_mutex_lock(&lock);
+		for (i = 0; i < BATCH; i++) {
+			if (!(ptr = qheap_alloc(heap, (c + 1) * CLASSSZ - 4)))
+				break;
+			LINK(ptr) = t->bin[c];
+			t->bin[c] = ptr;
+			t->count[c]++;
 		}
+		pthread_mutex_unlock(&lock);
+		if (!t->bin[c])
+			return NULL;
 	}
+	ptr = t->bin[c];
+	t->bin[c] = LINK(ptr);
+	t->count[c]--;
+	return ptr;
 }
+
+/* A block goes on the list of the biggest class it can stand in for. Its
+ * size can be read without the lock: a neighbour changing may flip PFREE in
+ * the same word, but the size bits are ours until the block goes back. */
+void qfree(void *ptr) {
+	void *p = (char*)ptr - 4;
+	struct tcache *t;
+	unsigned b;
+	int c;
+
+	if (!ptr)
+		return;
+	b = __atomic_load_n((unsigned*)p, __ATOMIC_RELAXED) & ~3;
+	if (b > CLASSES * CLASSSZ) {
+		pthread_mutex_lock(&lock);
+		qheap_free(heap, ptr);
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	t = tget();
+	c = b / CLASSSZ - 1;
+	LINK(ptr) = t->bin[c];
+	t->bin[c] = ptr;
+	if (++t->count[c] > CACHEMAX)
+		tflush(t, c, BATCH);
+}
+
+void *qrealloc(void *ptr, unsigned size) {
+	void *p = (char*)ptr - 4;
+	void *n;
+	unsigned old;
+	int r;
+
+	if (!ptr)
+		return qalloc(size);
+	pthread_mutex_lock(&lock);
+	r = resize(heap, ptr, size);
+	pthread_mutex_unlock(&lock);
+	if (r)
+		return ptr;
+	if (!(n = qalloc(size)))
+		return NULL;
+	old = BSZ(p) - 4;
+	copy(n, ptr, old < size ? old : size);
+	qfree(ptr);
+	return n;
+}
+
+void *qcalloc(unsigned n, unsigned size) {
+	void *ptr;
+
+	if (size && n > ~0u / size)
+		return NULL;
+	if ((ptr = qalloc(n * size)))
+		zero(ptr, n * size);
+	return ptr;
+}
+
+void *qalloc_aligned(unsigned align, unsigned size) {
+	void *ptr;
+
+	if (!heap)
+		return NULL;
+	pthread_mutex_lock(&lock);
+	ptr = qheap_alloc_aligned(heap, align, size);
+	pthread_mutex_unlock(&lock);
+	return ptr;
+}
+
+/* Blocks sitting in thread caches count as in use. */
+void qstats(struct qstats *st) {
+	pthread_mutex_lock(&lock);
+	qheap_stats(heap, st);
+	pthread_mutex_unlock(&lock);
+}
+
+/* fn runs under the lock, and mustn't call back in. */
+void qwalk(void (*fn)(void *ptr, unsigned size, int used, void *arg),
+           void *arg) {
+	pthread_mutex_lock(&lock);
+	qheap_walk(heap, fn, arg);
+	pthread_mutex_unlock(&lock);
+}
+
+void *qcheck(void) {
+	void *p;
+
+	pthread_mutex_lock(&lock);
+	p = qheap_check(heap);
+	pthread_mutex_unlock(&lock);
+	return p;
+}
+
+#endif /* QALLOC_THREADS */
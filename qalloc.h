@@ -0,0 +1,67 @@
+/* qalloc.h */
+
+#ifndef QALLOC_H
+#define QALLOC_H
+
+struct qheap;
+
+/* sizes are in bytes, block headers included */
+struct qstats {
+	unsigned size;		/* the whole heap */
+	unsigned inuse;
+	unsigned free;
+	unsigned largest;	/* free block */
+	unsigned nfree;		/* free blocks */
+	unsigned peak;		/* the most ever in use */
+	double frag;		/* 1 - largest / free */
+};
+
+struct qheap *qheap_init(void *start, unsigned size);
+void *qheap_alloc(struct qheap *h, unsigned size);
+void qheap_free(struct qheap *h, void *ptr);
+void *qheap_realloc(struct qheap *h, void *ptr, unsigned size);
+void *qheap_calloc(struct qheap *h, unsigned n, unsigned size);
+void *qheap_alloc_aligned(struct qheap *h, unsigned align, unsigned size);
+unsigned qsize(void *ptr);		/* usable bytes, of any heap's block */
+/* growing at the end on demand, and giving back empty segments */
+void qheap_segments(struct qheap *h, unsigned seg,
+                    unsigned (*grow)(void *end, unsigned size),
+                    void (*release)(void *ptr, unsigned size));
+void qheap_stats(struct qheap *h, struct qstats *st);
+void qheap_walk(struct qheap *h, void (*fn)(void *ptr, unsigned size,
+                                            int used, void *arg), void *arg);
+void *qheap_check(struct qheap *h);	/* the first bad block, or NULL */
+
+/* the same, on one default heap; built with QALLOC_THREADS, these are
+ * thread-safe and keep per-thread caches of small blocks */
+void qinit(void *start, unsigned size);
+void qsegments(unsigned seg, unsigned (*grow)(void *end, unsigned size),
+               void (*release)(void *ptr, unsigned size));
+void *qalloc(unsigned size);
+void qfree(void *ptr);
+void *qrealloc(void *ptr, unsigned size);
+void *qcalloc(unsigned n, unsigned size);
+void *qalloc_aligned(unsigned align, unsigned size);
+void qstats(struct qstats *st);
+void qwalk(void (*fn)(void *ptr, unsigned size, int used, void *arg),
+           void *arg);
+void *qcheck(void);
+#ifdef QALLOC_THREADS
+void qlock(void);
+void qunlock(void);
+#endif
+
+/* bump allocation: objects are freed together, by release or reset */
+struct qregion;
+
+struct qregion *qregion_init(void *start, unsigned size);
+void *qregion_alloc(struct qregion *r, unsigned size);
+void qregion_free(struct qregion *r, void *ptr);
+void *qregion_mark(struct qregion *r);
+void qregion_release(struct qregion *r, void *mark);
+void qregion_reset(struct qregion *r);
+/* a region carved out of a heap block */
+struct qregion *qregion_new(struct qheap *h, unsigned size);
+void qregion_delete(struct qheap *h, struct qregion *r);
+
+#endif /* !QALLOC_H */
@@ -0,0 +1,241 @@
+/* qmalloc.c - malloc and friends on qalloc, for LD_PRELOAD
+ * Run as: LD_PRELOAD=./qmalloc.so [QMALLOC_MB=n] program...
+ * The heap is qalloc's default one, built with its thread caches. On first
+ * use, n megabytes of address space (4095 by default, the most qalloc can
+ * index) are reserved, and the heap starts in one segment at the bottom of
+ * them, growing a segment at a time as it runs out. Segments come from the
+ * huge page pool while it has room, and are otherwise normal pages with
+ * transparent huge pages suggested. Every huge page's worth of a free block
+ * goes back to the kernel with MADV_DONTNEED once it is empty. Frees of
+ * blocks from outside the arena (made before we were loaded) are ignored.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "qalloc.h"
+
+#define ALIGNMENT 16		/* what glibc's malloc promises */
+#define HUGEPAGE (2 << 20)
+#define SEGMENT (8 * HUGEPAGE)	/* the heap grows by this much at least */
+#define MAXALIGN (1u << 30)
+
+static char *arena;
+static char *arenaend;		/* of the reservation */
+static int hugetlb = 1;		/* the pool hasn't run out yet */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void die(const char *msg) {
+	ssize_t n = write(2, msg, strlen(msg));
+
+	(void)n;
+	abort();
+}
+
+/* Maps the size bytes at p over the reservation. The huge page mapping has
+ * no MAP_NORESERVE, so a short pool fails here and not on a fault. */
+static int map(char *p, size_t size) {
+	if (hugetlb && mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+	                    MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+	                    -1, 0) != MAP_FAILED)
+		return 0;
+	hugetlb = 0;
+	if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS |
+	         MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+		return -1;
+	madvise(p, size, MADV_HUGEPAGE);
+	return 0;
+}
+
+static unsigned grow(void *end, unsigned size) {
+	size_t n = ((size_t)size + SEGMENT - 1) & -SEGMENT;
+
+	if (n > (size_t)(arenaend - (char*)end))
+		n = arenaend - (char*)end;
+	if (n < size || map(end, n) == -1)
+		return 0;
+	return n;
+}
+
+static void release(void *ptr, unsigned size) {
+	madvise(ptr, size, MADV_DONTNEED);
+}
+
+static void init(void) {
+	const char *s = getenv("QMALLOC_MB");
+	size_t size = (size_t)(s && atoi(s) > 0 ? atoi(s) : 4095) << 20;
+	char *p, *a;
+
+	if (size > (size_t)4095 << 20)
+		size = (size_t)4095 << 20;
+	size &= -HUGEPAGE;
+	if (size < SEGMENT)
+		size = SEGMENT;
+	/* lined up on a huge page, so every segment can be made of them */
+	p = mmap(NULL, size + HUGEPAGE, PROT_NONE,
+	         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED)
+		die("qmalloc: can't reserve the arena\n");
+	a = (char*)(((uintptr_t)p + HUGEPAGE - 1) & -HUGEPAGE);
+	if (a > p)
+		munmap(p, a - p);
+	munmap(a + size, p + HUGEPAGE - a);
+	arena = a;
+	arenaend = a + size;
+	if (map(arena, SEGMENT) == -1)
+		die("qmalloc: can't map the arena\n");
+	qinit(arena, SEGMENT);
+	qsegments(HUGEPAGE, grow, release);
+}
+
+/* Registering may allocate, so it can't happen from inside malloc. */
+__attribute__((constructor)) static void atfork(void) {
+	pthread_atfork(qlock, qunlock, qunlock);
+}
+
+/* qalloc's blocks are only 4-aligned, so each is taken bigger than asked
+ * and the pointer handed out is moved up to the alignment wanted; the word
+ * before it says by how much. */
+static void *place(char *ptr, size_t align) {
+	char *ret;
+
+	if (!ptr) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ret = (char*)(((uintptr_t)ptr + 4 + align - 1) & -align);
+	((unsigned*)ret)[-1] = ret - ptr;
+	return ret;
+}
+
+static char *base(void *ptr) {
+	return (char*)ptr - ((unsigned*)ptr)[-1];
+}
+
+static int ours(void *ptr) {
+	return (char*)ptr >= arena && (char*)ptr < arenaend;
+}
+
+/* The block's 4-aligned, so align more bytes always hold an aligned size
+ * with the offset word in front; what's left past it is given back, which
+ * keeps the cost of an alignment under align bytes. */
+static void *aligned(size_t align, size_t size) {
+	char *ptr, *ret;
+
+	pthread_once(&once, init);
+	if (align < ALIGNMENT)
+		align = ALIGNMENT;
+	while (align & (align - 1))
+		align += align & -align;
+	if (align > MAXALIGN || size > ~0u - 2 * align) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ptr = qalloc(size + align);
+	ret = place(ptr, align);
+	if (ret && align > ALIGNMENT)
+		qrealloc(ptr, ret - ptr + size);
+	return ret;
+}
+
+void *malloc(size_t size) {
+	return aligned(ALIGNMENT, size);
+}
+
+void free(void *ptr) {
+	if (ptr && ours(ptr))
+		qfree(base(ptr));
+}
+
+void *calloc(size_t n, size_t size) {
+	void *ptr;
+
+	if (size && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((ptr = aligned(ALIGNMENT, n * size)))
+		memset(ptr, 0, n * size);
+	return ptr;
+}
+
+/* The block is resized with the data where it was in it, and then the data
+ * moved if the new block wants a different offset. */
+void *realloc(void *ptr, size_t size) {
+	char *old, *n, *ret;
+	size_t off, keep;
+
+	if (!ptr)
+		return aligned(ALIGNMENT, size);
+	if (!size) {
+		free(ptr);
+		return NULL;
+	}
+	if (!ours(ptr))
+		die("qmalloc: realloc of a block from before qmalloc\n");
+	old = base(ptr);
+	off = (char*)ptr - old;
+	keep = qsize(old) - off;
+	if (keep > size)
+		keep = size;
+	if (size > ~0u - off - ALIGNMENT ||
+	    !(n = qrealloc(old, (off > ALIGNMENT ? off : ALIGNMENT) + size))) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ret = (char*)(((uintptr_t)n + 4 + ALIGNMENT - 1) & -ALIGNMENT);
+	if (ret != n + off)
+		memmove(ret, n + off, keep);
+	((unsigned*)ret)[-1] = ret - n;
+	return ret;
+}
+
+void *reallocarray(void *ptr, size_t n, size_t size) {
+	if (size && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, n * size);
+}
+
+int posix_memalign(void **res, size_t align, size_t size) {
+	void *ptr;
+
+	if (!align || align & (align - 1) || align % sizeof(void*))
+		return EINVAL;
+	if (!(ptr = aligned(align, size)))
+		return ENOMEM;
+	*res = ptr;
+	return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+	return aligned(align, size);
+}
+
+void *memalign(size_t align, size_t size) {
+	return aligned(align, size);
+}
+
+void *valloc(size_t size) {
+	return aligned(getpagesize(), size);
+}
+
+void *pvalloc(size_t size) {
+	size_t page = getpagesize();
+
+	return aligned(page, (size + page - 1) & -page);
+}
+
+size_t malloc_usable_size(void *ptr) {
+	if (!ptr || !ours(ptr))
+		return 0;
+	return qsize(base(ptr)) - ((char*)ptr - base(ptr));
+}
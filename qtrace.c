@@ -0,0 +1,199 @@
+/* qtrace.c - records a program's allocations for qalloc-bench
+ * Run as: LD_PRELOAD=./qtrace.so [QTRACE=prefix] program...
+ * Every malloc, calloc, realloc, free and aligned allocation goes to glibc as
+ * usual and is logged to prefix.<pid> (prefix defaults to "qtrace"); a child
+ * after fork() starts a file of its own. Each call and its record are made
+ * under one lock, so the trace order is the order things happened in, at the
+ * cost of the program's allocations never running side by side. Records are
+ * buffered and written at exit, so a process that leaves through _exit() or a
+ * signal loses its last few thousand.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qtrace.h"
+
+#define BUFRECS 4096
+
+/* glibc's own, which never come back through here */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *ptr);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct qtrace_rec buf[BUFRECS];
+static int nbuf;
+static int fd = -1;
+
+static void flush(void) {
+	char *p = (char*)buf;
+	size_t left = nbuf * sizeof *buf;
+	ssize_t n;
+
+	nbuf = 0;
+	while (fd != -1 && left) {
+		if ((n = write(fd, p, left)) == -1) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			fd = -1;
+			break;
+		}
+		p += n;
+		left -= n;
+	}
+}
+
+static void record(uint32_t op, uint32_t align, uint64_t size, void *ptr,
+                   void *old) {
+	struct qtrace_rec *r;
+
+	if (fd == -1)
+		return;
+	r = &buf[nbuf++];
+	r->op = op;
+	r->align = align;
+	r->size = size;
+	r->ptr = (uintptr_t)ptr;
+	r->old = (uintptr_t)old;
+	if (nbuf == BUFRECS)
+		flush();
+}
+
+/* Opens prefix.<pid>, without anything that might allocate. */
+static void start(void) {
+	struct qtrace_hdr h;
+	const char *prefix = getenv("QTRACE");
+	char path[4096], num[24];
+	char *p = num + sizeof num;
+	pid_t pid = getpid();
+	size_t len;
+
+	if (!prefix || !*prefix)
+		prefix = "qtrace";
+	*--p = '\0';
+	do
+		*--p = '0' + pid % 10;
+	while (pid /= 10);
+	if ((len = strlen(prefix)) + 1 + strlen(p) >= sizeof path)
+		return;
+	memcpy(path, prefix, len);
+	path[len] = '.';
+	strcpy(path + len + 1, p);
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	               0644)) == -1)
+		return;
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, QTRACE_MAGIC, 4);
+	h.version = QTRACE_VERSION;
+	h.pid = getpid();
+	if (write(fd, &h, sizeof h) != sizeof h) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+static void prefork(void) {
+	pthread_mutex_lock(&lock);
+}
+
+static void postfork(void) {
+	pthread_mutex_unlock(&lock);
+}
+
+/* The parent's records stay the parent's. */
+static void child(void) {
+	nbuf = 0;
+	if (fd != -1)
+		close(fd);
+	start();
+	pthread_mutex_unlock(&lock);
+}
+
+__attribute__((constructor)) static void init(void) {
+	pthread_mutex_lock(&lock);
+	start();
+	pthread_mutex_unlock(&lock);
+	pthread_atfork(prefork, postfork, child);
+}
+
+__attribute__((destructor)) static void fini(void) {
+	pthread_mutex_lock(&lock);
+	flush();
+	if (fd != -1)
+		close(fd);
+	fd = -1;
+	pthread_mutex_unlock(&lock);
+}
+
+void *malloc(size_t size) {
+	void *ptr;
+
+	pthread_mutex_lock(&lock);
+	ptr = __libc_malloc(size);
+	record(QT_MALLOC, 0, size, ptr, NULL);
+	pthread_mutex_unlock(&lock);
+	return ptr;
+}
+
+void *calloc(size_t n, size_t size) {
+	void *ptr;
+
+	pthread_mutex_lock(&lock);
+	ptr = __libc_calloc(n, size);
+	record(QT_CALLOC, 0, n * size, ptr, NULL);
+	pthread_mutex_unlock(&lock);
+	return ptr;
+}
+
+void *realloc(void *old, size_t size) {
+	void *ptr;
+
+	pthread_mutex_lock(&lock);
+	ptr = __libc_realloc(old, size);
+	record(QT_REALLOC, 0, size, ptr, old);
+	pthread_mutex_unlock(&lock);
+	return ptr;
+}
+
+void free(void *ptr) {
+	if (!ptr)
+		return;
+	pthread_mutex_lock(&lock);
+	__libc_free(ptr);
+	record(QT_FREE, 0, 0, NULL, ptr);
+	pthread_mutex_unlock(&lock);
+}
+
+static void *aligned(size_t align, size_t size) {
+	void *ptr;
+
+	pthread_mutex_lock(&lock);
+	ptr = __libc_memalign(align, size);
+	record(QT_MEMALIGN, align, size, ptr, NULL);
+	pthread_mutex_unlock(&lock);
+	return ptr;
+}
+
+int posix_memalign(void **res, size_t align, size_t size) {
+	if (!align || align & (align - 1) || align % sizeof(void*))
+		return EINVAL;
+	return (*res = aligned(align, size)) || !size ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+	return aligned(align, size);
+}
+
+void *memalign(size_t align, size_t size) {
+	return aligned(align, size);
+}
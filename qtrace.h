@@ -0,0 +1,38 @@
+/* qtrace.h - allocation traces, as written by qtrace.so and replayed by
+ * qalloc-bench. A trace is a struct qtrace_hdr followed by one struct
+ * qtrace_rec per call, in the order the calls returned, in host byte order.
+ * Pointers are the ones the traced program saw; they only serve to tie a
+ * free or realloc back to the call that made the block.
+ */
+
+#ifndef QTRACE_H
+#define QTRACE_H
+
+#include <stdint.h>
+
+#define QTRACE_MAGIC	"QTRC"
+#define QTRACE_VERSION	1
+
+enum {
+	QT_MALLOC = 1,
+	QT_CALLOC,	/* size is the product */
+	QT_REALLOC,
+	QT_MEMALIGN,	/* posix_memalign, aligned_alloc and memalign */
+	QT_FREE
+};
+
+struct qtrace_hdr {
+	char magic[4];
+	uint32_t version;
+	uint64_t pid;
+};
+
+struct qtrace_rec {
+	uint32_t op;
+	uint32_t align;		/* QT_MEMALIGN */
+	uint64_t size;
+	uint64_t ptr;		/* returned, or 0 */
+	uint64_t old;		/* freed or resized */
+};
+
+#endif /* !QTRACE_H */
@@ -0,0 +1,404 @@
+/* sha256mb.c - multi-buffer SHA-256 for merkle leaves
+ * Merkle leaves are independent and all the same size, so instead of hashing
+ * them one after another, sha256mb_hasher's batch entry point runs sixteen (on
+ * AVX-512) or eight (on AVX2) of them at once, one per 32-bit vector lane.
+ * Streams that don't fill a group, and the ordinary init/update/final path,
+ * use SHA-NI when the CPU has it and plain C when it doesn't. Where SHA-NI is
+ * there, it keeps up with eight AVX2 lanes, so those are only used without
+ * it. Output is plain SHA-256.
+ */
+
+#include <cpuid.h>
+#include <immintrin.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "merkle.h"
+
+
+struct sha256 {
+	uint32_t h[8];
+	unsigned char buf[64];
+	size_t fill;
+	uint64_t len;
+};
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static uint32_t be32(const unsigned char *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void blocks_c(uint32_t h[8], const unsigned char *p, size_t n) {
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, hh, t1, t2;
+	int t;
+
+	for (; n; n--, p += 64) {
+		for (t = 0; t < 16; t++)
+			w[t] = be32(p + 4 * t);
+		for (; t < 64; t++)
+			w[t] = w[t - 16] + w[t - 7] +
+			       (ROR(w[t - 15], 7) ^ ROR(w[t - 15], 18) ^
+			        (w[t - 15] >> 3)) +
+			       (ROR(w[t - 2], 17) ^ ROR(w[t - 2], 19) ^
+			        (w[t - 2] >> 10));
+		a = h[0]; b = h[1]; c = h[2]; d = h[3];
+		e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+		for (t = 0; t < 64; t++) {
+			t1 = hh + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+			     ((e & f) ^ (~e & g)) + K[t] + w[t];
+			t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+			     ((a & b) ^ (a & c) ^ (b & c));
+			hh = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+	}
+}
+
+/* The SHA-NI state is kept as ABEF/CDGH pairs; each message quad is extended
+ * from the previous four with sha256msg1/msg2. */
+__attribute__((target("sha,sse4.1")))
+static void blocks_shani(uint32_t h[8], const unsigned char *p, size_t n) {
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	                                     0x0405060700010203ULL);
+	__m128i st0, st1, tmp, save0, save1, msg, m[4];
+	int i;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);
+	st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);
+	st0 = _mm_alignr_epi8(tmp, st1, 8);
+	st1 = _mm_blend_epi16(st1, tmp, 0xf0);
+
+	for (; n; n--, p += 64) {
+		save0 = st0;
+		save1 = st1;
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+				        (const __m128i *)(p + 16 * i)), bswap);
+			else
+				m[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(
+				        _mm_sha256msg1_epu32(m[i & 3],
+				                             m[(i + 1) & 3]),
+				        _mm_alignr_epi8(m[(i + 3) & 3],
+				                        m[(i + 2) & 3], 4)),
+				        m[(i + 3) & 3]);
+			msg = _mm_add_epi32(m[i & 3],
+			        _mm_loadu_si128((const __m128i *)&K[4 * i]));
+			st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+			st0 = _mm_sha256rnds2_epu32(st0, st1,
+			                            _mm_shuffle_epi32(msg, 0x0e));
+		}
+		st0 = _mm_add_epi32(st0, save0);
+		st1 = _mm_add_epi32(st1, save1);
+	}
+
+	tmp = _mm_shuffle_epi32(st0, 0x1b);
+	st1 = _mm_shuffle_epi32(st1, 0xb1);
+	st0 = _mm_blend_epi16(tmp, st1, 0xf0);
+	st1 = _mm_alignr_epi8(st1, tmp, 8);
+	_mm_storeu_si128((__m128i *)&h[0], st0);
+	_mm_storeu_si128((__m128i *)&h[4], st1);
+}
+
+#define VROR(x, n)	_mm256_or_si256(_mm256_srli_epi32(x, n), \
+			                _mm256_slli_epi32(x, 32 - (n)))
+#define VADD(a, b)	_mm256_add_epi32(a, b)
+#define VXOR(a, b)	_mm256_xor_si256(a, b)
+
+/* Eight independent streams, lane i reading its blocks from base + i*stride.
+ * s[] holds the transposed state: s[0] is every lane's A, and so on. */
+__attribute__((target("avx2")))
+static void blocks_x8(__m256i s[8], const unsigned char *base, size_t stride,
+                      size_t n) {
+	const __m256i bswap = _mm256_set_epi8(
+	        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+	        12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	const __m256i idx = _mm256_setr_epi32(0, stride, 2 * stride,
+	        3 * stride, 4 * stride, 5 * stride, 6 * stride, 7 * stride);
+	__m256i w[16];
+	__m256i a, b, c, d, e, f, g, h, t1, t2, x, y;
+	int t;
+
+	for (; n; n--, base += 64) {
+		a = s[0]; b = s[1]; c = s[2]; d = s[3];
+		e = s[4]; f = s[5]; g = s[6]; h = s[7];
+		for (t = 0; t < 64; t++) {
+			if (t < 16) {
+				w[t] = _mm256_shuffle_epi8(_mm256_i32gather_epi32(
+				        (const int *)(base + 4 * t), idx, 1), bswap);
+			} else {
+				x = w[(t - 15) & 15];
+				y = w[(t - 2) & 15];
+				w[t & 15] = VADD(VADD(w[t & 15], w[(t - 7) & 15]),
+				        VADD(VXOR(VXOR(VROR(x, 7), VROR(x, 18)),
+				                  _mm256_srli_epi32(x, 3)),
+				             VXOR(VXOR(VROR(y, 17), VROR(y, 19)),
+				                  _mm256_srli_epi32(y, 10))));
+			}
+			t1 = VADD(VADD(h, VXOR(VXOR(VROR(e, 6), VROR(e, 11)),
+			                       VROR(e, 25))),
+			          VADD(VXOR(_mm256_and_si256(e, f),
+			                    _mm256_andnot_si256(e, g)),
+			               VADD(_mm256_set1_epi32(K[t]), w[t & 15])));
+			t2 = VADD(VXOR(VXOR(VROR(a, 2), VROR(a, 13)), VROR(a, 22)),
+			          VXOR(_mm256_and_si256(a, b),
+			               _mm256_and_si256(c, VXOR(a, b))));
+			h = g; g = f; f = e; e = VADD(d, t1);
+			d = c; c = b; b = a; a = VADD(t1, t2);
+		}
+		s[0] = VADD(s[0], a); s[1] = VADD(s[1], b);
+		s[2] = VADD(s[2], c); s[3] = VADD(s[3], d);
+		s[4] = VADD(s[4], e); s[5] = VADD(s[5], f);
+		s[6] = VADD(s[6], g); s[7] = VADD(s[7], h);
+	}
+}
+
+#define WROR(x, n)	_mm512_ror_epi32(x, n)
+#define WADD(a, b)	_mm512_add_epi32(a, b)
+#define WXOR3(a, b, c)	_mm512_ternarylogic_epi32(a, b, c, 0x96)
+
+/* blocks_x8() again, sixteen wide. AVX-512 has real rotates, and ternary
+ * logic folds Ch, Maj and the three-way xors into one instruction each. */
+__attribute__((target("avx512f,avx512bw")))
+static void blocks_x16(__m512i s[8], const unsigned char *base, size_t stride,
+                       size_t n) {
+	const __m512i bswap = _mm512_set4_epi32(0x0c0d0e0f, 0x08090a0b,
+	                                        0x04050607, 0x00010203);
+	const __m512i idx = _mm512_mullo_epi32(_mm512_set1_epi32(stride),
+	        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+	                          14, 15));
+	__m512i w[16];
+	__m512i a, b, c, d, e, f, g, h, t1, t2, x, y;
+	int t;
+
+	for (; n; n--, base += 64) {
+		a = s[0]; b = s[1]; c = s[2]; d = s[3];
+		e = s[4]; f = s[5]; g = s[6]; h = s[7];
+		for (t = 0; t < 64; t++) {
+			if (t < 16) {
+				w[t] = _mm512_shuffle_epi8(_mm512_i32gather_epi32(idx,
+				        (const int *)(base + 4 * t), 1), bswap);
+			} else {
+				x = w[(t - 15) & 15];
+				y = w[(t - 2) & 15];
+				w[t & 15] = WADD(WADD(w[t & 15], w[(t - 7) & 15]),
+				        WADD(WXOR3(WROR(x, 7), WROR(x, 18),
+				                   _mm512_srli_epi32(x, 3)),
+				             WXOR3(WROR(y, 17), WROR(y, 19),
+				                   _mm512_srli_epi32(y, 10))));
+			}
+			t1 = WADD(WADD(h, WXOR3(WROR(e, 6), WROR(e, 11),
+			                        WROR(e, 25))),
+			          WADD(_mm512_ternarylogic_epi32(e, f, g, 0xca),
+			               WADD(_mm512_set1_epi32(K[t]), w[t & 15])));
+			t2 = WADD(WXOR3(WROR(a, 2), WROR(a, 13), WROR(a, 22)),
+			          _mm512_ternarylogic_epi32(a, b, c, 0xe8));
+			h = g; g = f; f = e; e = WADD(d, t1);
+			d = c; c = b; b = a; a = WADD(t1, t2);
+		}
+		s[0] = WADD(s[0], a); s[1] = WADD(s[1], b);
+		s[2] = WADD(s[2], c); s[3] = WADD(s[3], d);
+		s[4] = WADD(s[4], e); s[5] = WADD(s[5], f);
+		s[6] = WADD(s[6], g); s[7] = WADD(s[7], h);
+	}
+}
+
+/* The final one or two blocks of a message of len bytes whose last rem bytes
+ * are at p; returns how many blocks were written to out. */
+static size_t pad(unsigned char out[128], const unsigned char *p, size_t rem,
+                  uint64_t len) {
+	size_t n = rem < 56 ? 1 : 2;
+
+	memset(out, 0, 64 * n);
+	memcpy(out, p, rem);
+	out[rem] = 0x80;
+	put32(out + 64 * n - 8, (len * 8) >> 32);
+	put32(out + 64 * n - 4, len * 8);
+	return n;
+}
+
+__attribute__((target("avx2")))
+static void batch_x8(const unsigned char *buf, size_t sz, unsigned char *out) {
+	unsigned char tail[8][128];
+	uint32_t lanes[8][8];
+	__m256i s[8];
+	size_t nfull = sz / 64;
+	size_t ntail = 0;
+	int i, j;
+
+	for (i = 0; i < 8; i++)
+		s[i] = _mm256_set1_epi32(H0[i]);
+	blocks_x8(s, buf, sz, nfull);
+	for (j = 0; j < 8; j++)
+		ntail = pad(tail[j], buf + j * sz + nfull * 64, sz % 64, sz);
+	blocks_x8(s, tail[0], sizeof(tail[0]), ntail);
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)lanes[i], s[i]);
+	for (j = 0; j < 8; j++)
+		for (i = 0; i < 8; i++)
+			put32(out + 32 * j + 4 * i, lanes[i][j]);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void batch_x16(const unsigned char *buf, size_t sz, unsigned char *out) {
+	unsigned char tail[16][128];
+	uint32_t lanes[8][16];
+	__m512i s[8];
+	size_t nfull = sz / 64;
+	size_t ntail = 0;
+	int i, j;
+
+	for (i = 0; i < 8; i++)
+		s[i] = _mm512_set1_epi32(H0[i]);
+	blocks_x16(s, buf, sz, nfull);
+	for (j = 0; j < 16; j++)
+		ntail = pad(tail[j], buf + j * sz + nfull * 64, sz % 64, sz);
+	blocks_x16(s, tail[0], sizeof(tail[0]), ntail);
+	for (i = 0; i < 8; i++)
+		_mm512_storeu_si512(lanes[i], s[i]);
+	for (j = 0; j < 16; j++)
+		for (i = 0; i < 8; i++)
+			put32(out + 32 * j + 4 * i, lanes[i][j]);
+}
+
+static void (*blocks)(uint32_t h[8], const unsigned char *p, size_t n);
+static int lanes;
+
+static void dispatch(void) {
+	unsigned a, b, c, d;
+
+	__builtin_cpu_init();
+	blocks = blocks_c;
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_SHA) &&
+	    __builtin_cpu_supports("sse4.1"))
+		blocks = blocks_shani;
+	if (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw"))
+		lanes = 16;
+	else if (__builtin_cpu_supports("avx2") && blocks != blocks_shani)
+		lanes = 8;
+}
+
+static void *sha256mb_new(void *aux) {
+	(void)aux;
+	if (!blocks)
+		dispatch();
+	return malloc(sizeof(struct sha256));
+}
+
+static void sha256mb_free(void *aux, void *hash) {
+	(void)aux;
+	free(hash);
+}
+
+static void sha256mb_init(void *aux, void *hash) {
+	struct sha256 *ctx = hash;
+	(void)aux;
+	memcpy(ctx->h, H0, sizeof(H0));
+	ctx->fill = 0;
+	ctx->len = 0;
+}
+
+static void sha256mb_update(void *aux, void *hash, const unsigned char *buf,
+                            size_t sz) {
+	struct sha256 *ctx = hash;
+	size_t n;
+	(void)aux;
+
+	ctx->len += sz;
+	if (ctx->fill) {
+		n = 64 - ctx->fill < sz ? 64 - ctx->fill : sz;
+		memcpy(ctx->buf + ctx->fill, buf, n);
+		ctx->fill += n;
+		buf += n;
+		sz -= n;
+		if (ctx->fill < 64)
+			return;
+		blocks(ctx->h, ctx->buf, 1);
+		ctx->fill = 0;
+	}
+	blocks(ctx->h, buf, sz / 64);
+	memcpy(ctx->buf, buf + sz / 64 * 64, sz % 64);
+	ctx->fill = sz % 64;
+}
+
+static void sha256mb_final(void *aux, void *hash, unsigned char *hashbuf) {
+	struct sha256 *ctx = hash;
+	unsigned char tail[128];
+	int i;
+	(void)aux;
+
+	blocks(ctx->h, tail, pad(tail, ctx->buf, ctx->fill, ctx->len));
+	for (i = 0; i < 8; i++)
+		put32(hashbuf + 4 * i, ctx->h[i]);
+}
+
+static void sha256mb_batch(void *aux, void *hash, const unsigned char *buf,
+                           size_t sz, size_t n, unsigned char *out) {
+
+	if (!blocks)
+		dispatch();
+	/* lanes gather from buf + i*sz with 32-bit offsets */
+	for (; lanes == 16 && sz <= INT_MAX / 16 && n >= 16; n -= 16) {
+		batch_x16(buf, sz, out);
+		buf += 16 * sz;
+		out += 16 * 32;
+	}
+	for (; lanes == 8 && sz <= INT_MAX / 8 && n >= 8; n -= 8) {
+		batch_x8(buf, sz, out);
+		buf += 8 * sz;
+		out += 8 * 32;
+	}
+	for (; n; n--) {
+		sha256mb_init(aux, hash);
+		sha256mb_update(aux, hash, buf, sz);
+		sha256mb_final(aux, hash, out);
+		buf += sz;
+		out += 32;
+	}
+}
+
+struct hasher sha256mb_hasher = {
+	.new = sha256mb_new,
+	.free = sha256mb_free,
+	.init = sha256mb_init,
+	.update = sha256mb_update,
+	.final = sha256mb_final,
+	.batch = sha256mb_batch,
+	.size = 32,
+	.aux = NULL,
+	.name = "sha256mb"
+};
@@ -23,22 +23,26 @@
 
 #include <ctype.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 /* A blob might own its data or not. If it owns its data, its viewing member is
- * null and it will free its data when its refcount drops to zero; otherwise, it
- * will hold a ref to its viewing member. */
+ * null and it will free its data when its refcount drops to zero (or unmap it,
+ * if it's a file mapping mapped bytes long); otherwise, it will hold a ref to
+ * its viewing member. */
 struct blob {
 	int refcount;
 	struct blob *viewing;
 	unsigned char *data;
 	size_t len;
+	size_t mapped;
 };
 
 void blob_ref(struct blob *b) {
@@ -51,6 +55,8 @@ void blob_unref(struct blob *b) {
 		return;
 	if (b->viewing)
 		blob_unref(b->viewing);
+	else if (b->mapped)
+		munmap(b->data, b->mapped);
 	else
 		free(b->data);
 }
@@ -61,6 +67,18 @@ struct blob *blob_new_data(unsigned char *data, size_t len) {
 	b->viewing = NULL;
 	b->data = data;
 	b->len = len;
+	b->mapped = 0;
+	return b;
+}
+
+/* Maps len bytes of fd read-only; they are paged in as they are touched. */
+struct blob *blob_new_map(int fd, size_t len) {
+	struct blob *b;
+	void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+	b = blob_new_data(data, len);
+	b->mapped = len;
 	return b;
 }
 
@@ -70,6 +88,7 @@ struct blob *blob_new_view(struct blob *viewing, size_t offset, size_t len) {
 	b->viewing = viewing;
 	b->data = viewing->data + offset;
 	b->len = len;
+	b->mapped = 0;
 	return b;
 }
 
@@ -390,12 +409,39 @@ void cmd_print() {
 	prval(0, v, 0);
 }
 
+/* Reads fd to the end, for files that can't be mapped (pipes, or anything
+ * whose size stat doesn't know). */
+struct blob *readall(int fd) {
+	size_t len = 0, cap = 4096;
+	unsigned char *buf, *nbuf;
+	ssize_t n;
+
+	if (!(buf = malloc(cap)))
+		return NULL;
+	while ((n = read(fd, buf + len, cap - len))) {
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			free(buf);
+			return NULL;
+		}
+		len += n;
+		if (len == cap) {
+			if (!(nbuf = realloc(buf, cap * 2))) {
+				free(buf);
+				return NULL;
+			}
+			buf = nbuf;
+			cap *= 2;
+		}
+	}
+	return blob_new_data(buf, len);
+}
+
 void cmd_read() {
 	struct stat st;
 	char b[PATH_MAX];
-	size_t sz;
-	unsigned char *buf;
-	struct blob *blob;
+	struct blob *blob = NULL;
 	int fd;
 
 	if (!popstrbuf(b, sizeof b)) {
@@ -403,23 +449,27 @@ void cmd_read() {
 		return;
 	}
 
-	if (stat(b, &st)) {
-		warn("stat(%s)", b);
-		return;
-	}
-
-	buf = malloc(st.st_size);
 	fd = open(b, O_RDONLY);
 	if (fd == -1) {
 		warn("open(%s)", b);
-		free(buf);
+		return;
+	}
+	if (fstat(fd, &st)) {
+		warn("stat(%s)", b);
+		close(fd);
 		return;
 	}
 
-	read(fd, buf, st.st_size);
+	if (S_ISREG(st.st_mode) && st.st_size > 0)
+		blob = blob_new_map(fd, st.st_size);
+	if (!blob)
+		blob = readall(fd);
+	if (!blob)
+		warn("read(%s)", b);
 	close(fd);
 
-	pushblob(blob_new_data(buf, st.st_size));
+	if (blob)
+		pushblob(blob);
 }
 
 void cmd_write() {